@@ -0,0 +1,273 @@
+/*
+    Benchmark harness
+
+    Runs every filter in a filter directory against every image in an image
+    directory, plus synthetic 1K and 4K images, under each convolution
+    engine, and reports the time per run, megapixels per second and peak
+    memory as CSV or JSON. The 16K image, which needs over 2 GB, is only
+    run with --large or when --sizes names it.
+
+    The peak memory is that of each case where Linux can reset the high
+    water mark through /proc/self/clear_refs. Elsewhere it is the peak of
+    the whole process so far, and the column says so.
+
+    bench [--runs N] [--sizes 1k,4k] [--large] [--json] filter_dir image_dir
+*/
+#include <fstream>
+#include <chrono>
+#include <dirent.h>
+#include <sys/resource.h>
+#include "functions.h"
+
+// one convolution engine: the method, thread count and simd level it runs with
+struct Engine{
+    string name;
+    ConvolveMethod method;
+    int threads;
+    SimdLevel simd;
+};
+
+// one row of the report
+struct Result{
+    string image, filter, engine;
+    int width, height, runs;
+    double min_ms, median_ms, p99_ms;
+    long peak_rss_kb;
+};
+
+// whether peakRSS measures each case on its own, set by the first reset
+bool rssPER_CASE = false;
+
+/*
+    Returns the sorted names of the files in directory ending in extension.
+*/
+vector<string> listFiles( string directory, string extension );
+
+/*
+    Fills ORIGINAL with a deterministic noisy gradient of the given size.
+*/
+void makeSyntheticImage( int width, int height );
+
+/*
+    Lowers the peak resident memory to the current one, so that peakRSS
+    covers what runs from here on. Returns whether the system allows it.
+*/
+bool resetPeakRSS();
+
+/*
+    Peak resident memory since the last resetPeakRSS, or of the process so
+    far if it could not reset, in kilobytes.
+*/
+long peakRSS();
+
+/*
+    Times runs repetitions of work and fills in the timing and memory
+    columns of result.
+*/
+void timeRuns( int runs, const function<void()>& work, Result& result );
+
+/*
+    Prints the results as CSV or as a JSON array.
+*/
+void printResults( const vector<Result>& results, bool json );
+
+
+vector<string> listFiles( string directory, string extension ){
+    vector<string> files;
+    DIR* dir = opendir( directory.c_str() );
+    if( !dir ){
+        cerr << "Failed to open directory: " << directory << ". Exiting... " << endl;
+        exit( 1 );
+    }
+    while( dirent* entry = readdir( dir ) ){
+        string name = entry->d_name;
+        if( name.size() > extension.size() && name.compare( name.size() - extension.size(), extension.size(), extension ) == 0 )
+            files.push_back( directory + "/" + name );
+    }
+    closedir( dir );
+    sort( files.begin(), files.end() );
+    return files;
+}
+
+void makeSyntheticImage( int width, int height ){
+    imWIDTH = width;
+    imHEIGHT = height;
+    ORIGINAL.resize( width, height );
+    Pixel** image = ORIGINAL.pixels;
+    unsigned int seed = 12345;
+    for( int y=0; y<height; y++ )
+        for( int x=0; x<width; x++ ){
+            seed = seed * 1103515245 + 12345;
+            unsigned char noise = ( seed >> 16 ) & 63;
+            image[y][x].r = ( x * 255 / width + noise ) & 255;
+            image[y][x].g = ( y * 255 / height + noise ) & 255;
+            image[y][x].b = (( x + y ) & 255 ) ^ noise;
+            image[y][x].a = 255;
+        }
+    IN = image;
+}
+
+bool resetPeakRSS(){
+    // writing 5 to clear_refs resets VmHWM, since Linux 4.0
+    ofstream clear( "/proc/self/clear_refs" );
+    clear << "5";
+    clear.close();
+    return !clear.fail();
+}
+
+long peakRSS(){
+    if( rssPER_CASE ){
+        ifstream status( "/proc/self/status" );
+        string line;
+        while( getline( status, line ) )
+            if( line.compare( 0, 6, "VmHWM:" ) == 0 ) return atol( line.c_str() + 6 );
+    }
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+void timeRuns( int runs, const function<void()>& work, Result& result ){
+    vector<double> times;
+    if( rssPER_CASE ) resetPeakRSS();
+    for( int i=0; i<runs; i++ ){
+        auto start = chrono::steady_clock::now();
+        work();
+        auto stop = chrono::steady_clock::now();
+        times.push_back( chrono::duration<double, milli>( stop - start ).count() );
+    }
+    sort( times.begin(), times.end() );
+
+    result.runs = runs;
+    result.min_ms = times[0];
+    result.median_ms = times[( runs - 1 ) / 2];
+    result.p99_ms = times[min( runs - 1, int( ceil( 0.99 * runs ) ) - 1 )];
+    result.peak_rss_kb = peakRSS();
+}
+
+void printResults( const vector<Result>& results, bool json ){
+    string rss = rssPER_CASE ? "peak_rss_kb" : "process_peak_rss_kb";
+    if( json ) cout << "[" << endl;
+    else cout << "image,width,height,filter,engine,runs,min_ms,median_ms,p99_ms,mpix_per_s," << rss << endl;
+
+    for( size_t i=0; i<results.size(); i++ ){
+        const Result& r = results[i];
+        double mpix_per_s = r.width * ( double )r.height / ( r.median_ms * 1000.0 );
+        if( json ){
+            cout << "  {\"image\": \"" << r.image << "\", \"width\": " << r.width << ", \"height\": " << r.height
+                 << ", \"filter\": \"" << r.filter << "\", \"engine\": \"" << r.engine << "\", \"runs\": " << r.runs
+                 << ", \"min_ms\": " << r.min_ms << ", \"median_ms\": " << r.median_ms << ", \"p99_ms\": " << r.p99_ms
+                 << ", \"mpix_per_s\": " << mpix_per_s << ", \"" << rss << "\": " << r.peak_rss_kb << "}"
+                 << ( i + 1 < results.size() ? "," : "" ) << endl;
+        } else {
+            cout << r.image << "," << r.width << "," << r.height << "," << r.filter << "," << r.engine << ","
+                 << r.runs << "," << r.min_ms << "," << r.median_ms << "," << r.p99_ms << ","
+                 << mpix_per_s << "," << r.peak_rss_kb << endl;
+        }
+    }
+    if( json ) cout << "]" << endl;
+}
+
+int main( int argc, char* argv[] ){
+    int runs = 5;
+    bool json = false;
+    string sizes = "1k,4k";
+    bool large = false;
+
+    int arg = 1;
+    while( arg < argc && string( argv[arg] ).compare( 0, 2, "--" ) == 0 ){
+        string option = argv[arg++];
+        if( option == "--json" ) json = true;
+        else if( option == "--runs" && arg < argc ) runs = max( 1, atoi( argv[arg++] ) );
+        else if( option == "--sizes" && arg < argc ) sizes = argv[arg++];
+        else if( option == "--large" ) large = true;
+        else {
+            cout << "Command Line Error: Unknown option " << option << "! Exiting..." << endl;
+            return( 0 );
+        }
+    }
+    if( argc - arg != 2 ){
+        cout << "Command Line Error: Needs a filter directory and an image directory! Exiting..." << endl;
+        return( 0 );
+    }
+
+    vector<string> filters = listFiles( argv[arg], ".filt" );
+    vector<string> images = listFiles( argv[arg+1], ".png" );
+    if( large && sizes.find( "16k" ) == string::npos ) sizes += ",16k";
+    rssPER_CASE = resetPeakRSS();
+
+    // synthetic images go by their 16:9 width: 1k, 4k, 16k
+    vector<pair<int, int>> synthetic;
+    for( size_t start=0; start<sizes.size(); ){
+        size_t end = min( sizes.find( ',', start ), sizes.size() );
+        string size = sizes.substr( start, end - start );
+        start = end + 1;
+        if( size == "1k" ) synthetic.push_back( make_pair( 1024, 576 ) );
+        else if( size == "4k" ) synthetic.push_back( make_pair( 3840, 2160 ) );
+        else if( size == "16k" ) synthetic.push_back( make_pair( 15360, 8640 ) );
+    }
+
+    SimdLevel best = cpuSimdLevel();
+    int cores = thread::hardware_concurrency() > 0 ? thread::hardware_concurrency() : 1;
+    vector<Engine> engines = {
+        { "naive", METHOD_NAIVE, 1, SIMD_SCALAR },
+        { "separable", METHOD_SEPARABLE, 1, SIMD_SCALAR },
+        { "simd", METHOD_DIRECT, 1, best },
+        { "threaded", METHOD_AUTO, cores, best },
+        { "fft", METHOD_FFT, 1, SIMD_SCALAR },
+        { "box", METHOD_BOX, 1, best },
+        { "fixed", METHOD_FIXED, 1, best },
+    };
+
+    vector<Result> results;
+    int count = images.size() + synthetic.size();
+    for( int i=0; i<count; i++ ){
+        Result base;
+        if( i < (int)images.size() ){
+            base.image = images[i];
+
+            // decoding is its own stage, timed once per image
+            Result decode = base;
+            decode.filter = "-";
+            decode.engine = "decode";
+            timeRuns( 1, [&]{ readImage( images[i] ); }, decode );
+            decode.width = imWIDTH;
+            decode.height = imHEIGHT;
+            results.push_back( decode );
+        } else {
+            base.image = "synthetic-" + to_string( synthetic[i - images.size()].first ) + "x" + to_string( synthetic[i - images.size()].second );
+            makeSyntheticImage( synthetic[i - images.size()].first, synthetic[i - images.size()].second );
+        }
+        base.width = imWIDTH;
+        base.height = imHEIGHT;
+        ensureWorkBuffers();
+
+        for( auto &filter : filters ){
+            loadPipeline( filter );
+            for( auto &engine : engines ){
+                // only rank 1 kernels have a separable engine, and only box
+                // and tent kernels a box one
+                if( engine.method == METHOD_SEPARABLE && !kernelSEPARABLE ) continue;
+                if( engine.method == METHOD_BOX && kernelBOXES.empty() ) continue;
+                METHOD = engine.method;
+                THREADS = engine.threads;
+                SIMD_LIMIT = engine.simd;
+
+                Result result = base;
+                result.filter = filter;
+                result.engine = engine.name;
+                timeRuns( runs, []{ applyKernel( ORIGINAL.pixels, WORK.pixels, imWIDTH, imHEIGHT ); }, result );
+                results.push_back( result );
+                cerr << result.image << " " << filter << " " << engine.name << ": " << result.median_ms << " ms" << endl;
+            }
+        }
+        destroy();
+    }
+
+    printResults( results, json );
+    return( 0 );
+}
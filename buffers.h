@@ -0,0 +1,225 @@
+/*
+    Recycled image memory.
+
+    Pixmaps, planes and the other per image buffers come out of BUFFERS, a
+    pool of 64 byte aligned blocks, instead of new and delete. A block given
+    back is kept idle and handed out again for the next request it fits, so
+    a batch of same sized images, or the passes of a pipeline, keep going
+    through the same few blocks and memory stays flat. Only the
+    BUFFER_IDLE most recently released blocks are kept, the older ones go
+    back to the system.
+
+    Buffer and Image own their block for as long as they live, and give it
+    back to the pool when they go. ORIGINAL, WORK and SCRATCH are Images,
+    and so are the images incremental.h keeps.
+
+    Pixmaps over mapped files, see rawio.h, are the one exception: their
+    pixels belong to the mapping recorded in MAPPINGS, which deletePixmap
+    unmaps instead.
+*/
+#include <cstdlib>
+#include <map>
+
+// alignment of every block, a cache line and a whole AVX2 vector or two
+const size_t BUFFER_ALIGN = 64;
+
+// idle blocks kept for reuse
+const size_t BUFFER_IDLE = 16;
+
+class BufferPool{
+public:
+    ~BufferPool();
+
+    /*
+        Returns a block of at least bytes bytes, aligned to BUFFER_ALIGN,
+        reusing an idle one if one fits without wasting more than half of it.
+        Its contents are undefined.
+    */
+    void* acquire( size_t bytes );
+
+    /*
+        Gives a block from acquire back to the pool.
+    */
+    void release( void* block );
+
+    /*
+        Frees all idle blocks.
+    */
+    void trim();
+
+private:
+    mutex lock;
+    // the size of every block handed out or idle
+    map<void*, size_t> sizes;
+    // oldest first
+    deque<void*> idle;
+};
+
+BufferPool BUFFERS;
+
+// a file mapping behind a pixmap
+struct Mapping{
+    void* data;
+    size_t size;
+};
+
+// pixmaps whose pixels live in a mapped file, freed by deletePixmap. Kept
+// here, ahead of the Images below, so that it outlives them at exit
+map<Pixel**, Mapping> MAPPINGS;
+
+/*
+    count elements of T from BUFFERS, given back when the buffer goes.
+*/
+template<typename T>
+class Buffer{
+public:
+    Buffer(){}
+    explicit Buffer( size_t count ){ resize( count ); }
+    ~Buffer(){ reset(); }
+    Buffer( const Buffer& ) = delete;
+    Buffer& operator=( const Buffer& ) = delete;
+
+    /*
+        Makes room for count elements, keeping the block if it is big
+        enough. The contents are undefined afterwards.
+    */
+    void resize( size_t count );
+
+    // sets every element to zero
+    void zero(){ memset( elements, 0, count * sizeof( T ) ); }
+
+    // gives the block back
+    void reset();
+
+    T* data(){ return elements; }
+    size_t size() const { return count; }
+    T& operator[]( size_t i ){ return elements[i]; }
+
+private:
+    T* elements = NULL;
+    size_t count = 0, capacity = 0;
+};
+
+/*
+    A width x height pixmap from BUFFERS, stored and laid out like the ones
+    of newPixmap, freed when the image goes.
+*/
+class Image{
+public:
+    Image(){}
+    Image( int w, int h ){ resize( w, h ); }
+    ~Image(){ deletePixmap( pixels ); }
+    Image( const Image& ) = delete;
+    Image& operator=( const Image& ) = delete;
+
+    /*
+        Sizes the image, keeping its pixels if the size does not change.
+    */
+    void resize( int w, int h );
+
+    /*
+        Takes over pixmap, a w x h one from newPixmap or over a mapped file,
+        in place of the pixels held so far.
+    */
+    void adopt( Pixel** pixmap, int w, int h );
+
+    // gives the pixels back, leaving the image empty
+    void reset();
+
+    Pixel** pixels = NULL;
+    int width = 0, height = 0;
+};
+
+// ORIGINAL holds the image as decoded and is never written after loading.
+// WORK and SCRATCH are the two work buffers, kept from one image to the
+// next while the size stays the same
+Image ORIGINAL, WORK, SCRATCH;
+
+
+BufferPool::~BufferPool(){
+    trim();
+}
+
+void* BufferPool::acquire( size_t bytes ){
+    bytes = max( BUFFER_ALIGN, ( bytes + BUFFER_ALIGN - 1 ) / BUFFER_ALIGN * BUFFER_ALIGN );
+    {
+        lock_guard<mutex> guard( lock );
+        // the smallest idle block that fits
+        auto best = idle.end();
+        for( auto it=idle.begin(); it!=idle.end(); ++it ){
+            size_t size = sizes[*it];
+            if( size >= bytes && size / 2 <= bytes && ( best == idle.end() || size < sizes[*best] ) ) best = it;
+        }
+        if( best != idle.end() ){
+            void* block = *best;
+            idle.erase( best );
+            return block;
+        }
+    }
+
+    void* block;
+    if( posix_memalign( &block, BUFFER_ALIGN, bytes ) != 0 ){
+        cerr << "Failed to allocate " << bytes << " bytes. Exiting... " << endl;
+        exit( 1 );
+    }
+    lock_guard<mutex> guard( lock );
+    sizes[block] = bytes;
+    return block;
+}
+
+void BufferPool::release( void* block ){
+    if( !block ) return;
+    lock_guard<mutex> guard( lock );
+    idle.push_back( block );
+    while( idle.size() > BUFFER_IDLE ){
+        sizes.erase( idle.front() );
+        free( idle.front() );
+        idle.pop_front();
+    }
+}
+
+void BufferPool::trim(){
+    lock_guard<mutex> guard( lock );
+    for( auto &block : idle ){
+        sizes.erase( block );
+        free( block );
+    }
+    idle.clear();
+}
+
+template<typename T>
+void Buffer<T>::resize( size_t n ){
+    if( n > capacity ){
+        reset();
+        elements = ( T* )BUFFERS.acquire( n * sizeof( T ) );
+        capacity = n;
+    }
+    count = n;
+}
+
+template<typename T>
+void Buffer<T>::reset(){
+    BUFFERS.release( elements );
+    elements = NULL;
+    count = capacity = 0;
+}
+
+void Image::resize( int w, int h ){
+    if( pixels && w == width && h == height ) return;
+    deletePixmap( pixels );
+    pixels = newPixmap( w, h );
+    width = w;
+    height = h;
+}
+
+void Image::adopt( Pixel** pixmap, int w, int h ){
+    if( pixmap != pixels ) deletePixmap( pixels );
+    pixels = pixmap;
+    width = w;
+    height = h;
+}
+
+void Image::reset(){
+    deletePixmap( pixels );
+    width = height = 0;
+}
@@ -0,0 +1,245 @@
+/*
+    Regression check
+
+    Convolves a synthetic image with the headless convolve binary under
+    every engine and border, for every filter in a filter directory, and
+    diffs each output against that of the naive floating point method.
+    Then checks that a fused pipeline matches the unfused reference away
+    from the edges, that .raw outputs, written in place or not, match the
+    others, that the kernel cache gives the same output cold and warm, and
+    that streaming matches the direct method. Prints each failing case, and
+    exits with 1 if there is any.
+
+    check [--binary ./convolve] [--work DIR] filter_dir
+*/
+#include <fstream>
+#include <dirent.h>
+#include "functions.h"
+
+// one convolution engine: its options and how far it may be off the naive
+// method, in channel levels
+struct Engine{
+    string name;
+    string options;
+    int tolerance;
+};
+
+// the convolve binary under test, and the directory its files go to
+string checkBINARY = "./convolve";
+string checkDIR = "check.out";
+
+int checkCASES = 0;
+int checkFAILURES = 0;
+
+/*
+    Returns the sorted names of the files in directory ending in extension.
+*/
+vector<string> listFiles( string directory, string extension );
+
+/*
+    Fills ORIGINAL with a deterministic noisy gradient of the given size.
+*/
+void makeSyntheticImage( int width, int height );
+
+/*
+    Runs the binary headless with options and filter over input into
+    output, all files of checkDIR. Returns false if it fails.
+*/
+bool runHeadless( string options, string filter, string input, string output );
+
+/*
+    Reads the image file of checkDIR into image. Returns false if it cannot
+    be read.
+*/
+bool readInto( string file, Image& image );
+
+/*
+    Largest rgb difference between the images a and b, leaving out margin
+    pixels at each edge, or -1 if their sizes differ.
+*/
+int compareImages( const Image& a, const Image& b, int margin );
+
+/*
+    Counts a case, and prints it as failed if the output file could not be
+    made and read, or deviates from the expected one by more than tolerance.
+*/
+void expect( string name, bool ran, const Image& output, const Image& expected, int tolerance, int margin = 0 );
+
+/*
+    Copies file a of checkDIR to b.
+*/
+void copyFile( string a, string b );
+
+
+vector<string> listFiles( string directory, string extension ){
+    vector<string> files;
+    DIR* dir = opendir( directory.c_str() );
+    if( !dir ){
+        cerr << "Failed to open directory: " << directory << ". Exiting... " << endl;
+        exit( 1 );
+    }
+    while( dirent* entry = readdir( dir ) ){
+        string name = entry->d_name;
+        if( name.size() > extension.size() && name.compare( name.size() - extension.size(), extension.size(), extension ) == 0 )
+            files.push_back( directory + "/" + name );
+    }
+    closedir( dir );
+    sort( files.begin(), files.end() );
+    return files;
+}
+
+void makeSyntheticImage( int width, int height ){
+    imWIDTH = width;
+    imHEIGHT = height;
+    ORIGINAL.resize( width, height );
+    Pixel** image = ORIGINAL.pixels;
+    unsigned int seed = 12345;
+    for( int y=0; y<height; y++ )
+        for( int x=0; x<width; x++ ){
+            seed = seed * 1103515245 + 12345;
+            unsigned char noise = ( seed >> 16 ) & 63;
+            image[y][x].r = ( x * 255 / width + noise ) & 255;
+            image[y][x].g = ( y * 255 / height + noise ) & 255;
+            image[y][x].b = (( x + y ) & 255 ) ^ noise;
+            image[y][x].a = 255;
+        }
+    IN = image;
+}
+
+bool runHeadless( string options, string filter, string input, string output ){
+    // a stale output from an earlier run must not pass for this one
+    string path = checkDIR + "/" + output;
+    if( output != input ) remove( path.c_str() );
+    string command = checkBINARY + " --headless " + options + " " + filter + " " + checkDIR + "/" + input + " " + path + " > /dev/null";
+    return system( command.c_str() ) == 0;
+}
+
+bool readInto( string file, Image& image ){
+    string error;
+    if( !loadImage( checkDIR + "/" + file, error ) ) return false;
+    image.resize( imWIDTH, imHEIGHT );
+    memcpy( image.pixels[0], ORIGINAL.pixels[0], (size_t)imWIDTH * imHEIGHT * sizeof( Pixel ) );
+    destroy();
+    return true;
+}
+
+int compareImages( const Image& a, const Image& b, int margin ){
+    if( a.width != b.width || a.height != b.height ) return -1;
+    int deviation = 0;
+    for( int y=margin; y<a.height-margin; y++ )
+        for( int x=margin; x<a.width-margin; x++ ){
+            deviation = max( deviation, abs( a.pixels[y][x].r - b.pixels[y][x].r ) );
+            deviation = max( deviation, abs( a.pixels[y][x].g - b.pixels[y][x].g ) );
+            deviation = max( deviation, abs( a.pixels[y][x].b - b.pixels[y][x].b ) );
+        }
+    return deviation;
+}
+
+void expect( string name, bool ran, const Image& output, const Image& expected, int tolerance, int margin ){
+    checkCASES++;
+    int deviation = ran ? compareImages( output, expected, margin ) : -1;
+    if( deviation >= 0 && deviation <= tolerance ) return;
+    checkFAILURES++;
+    if( deviation < 0 ) cout << "FAIL " << name << ": no output" << endl;
+    else cout << "FAIL " << name << ": off by " << deviation << ", allowed " << tolerance << endl;
+}
+
+void copyFile( string a, string b ){
+    ifstream in( checkDIR + "/" + a, ios::binary );
+    ofstream out( checkDIR + "/" + b, ios::binary );
+    out << in.rdbuf();
+}
+
+int main( int argc, char* argv[] ){
+    int arg = 1;
+    while( arg < argc && string( argv[arg] ).compare( 0, 2, "--" ) == 0 ){
+        string option = argv[arg++];
+        if( option == "--binary" && arg < argc ) checkBINARY = argv[arg++];
+        else if( option == "--work" && arg < argc ) checkDIR = argv[arg++];
+        else {
+            cout << "Command Line Error: Unknown option " << option << "! Exiting..." << endl;
+            return( 0 );
+        }
+    }
+    if( argc - arg != 1 ){
+        cout << "Command Line Error: Needs a filter directory! Exiting..." << endl;
+        return( 0 );
+    }
+    vector<string> filters = listFiles( argv[arg], ".filt" );
+    if( filters.size() < 2 ){
+        cerr << "Needs at least two filters in " << argv[arg] << ". Exiting... " << endl;
+        exit( 1 );
+    }
+    mkdir( checkDIR.c_str(), 0755 );
+
+    // odd sizes over a tile wide, so the vector tails and tile edges all run
+    makeSyntheticImage( 157, 93 );
+    writePixmap( checkDIR + "/in.ppm", ORIGINAL.pixels, imWIDTH, imHEIGHT );
+    writePixmap( checkDIR + "/in.png", ORIGINAL.pixels, imWIDTH, imHEIGHT );
+    writePixmap( checkDIR + "/in.raw", ORIGINAL.pixels, imWIDTH, imHEIGHT );
+    destroy();
+
+    // the floating point engines only differ from the naive method in the
+    // order of their sums, the fft in its transforms, and the fixed point
+    // one in its rounded weights
+    vector<Engine> engines = {
+        { "direct scalar", "--method direct --simd scalar", 1 },
+        { "direct", "--method direct", 1 },
+        { "separable", "--method separable", 1 },
+        { "fft", "--method fft", 1 },
+        { "box", "--method box", 1 },
+        { "fixed", "--method fixed", 1 },
+        { "auto threaded", "--method auto --threads 4", 1 },
+    };
+    vector<string> borders = { "zero", "clamp", "mirror", "wrap" };
+
+    Image reference, output;
+    for( auto &filter : filters ){
+        for( auto &border : borders ){
+            string options = " --border " + border;
+            if( !runHeadless( "--method naive" + options, filter, "in.ppm", "naive.ppm" ) || !readInto( "naive.ppm", reference ) ){
+                checkCASES++;
+                checkFAILURES++;
+                cout << "FAIL " << filter << " " << border << " naive: no output" << endl;
+                continue;
+            }
+            for( auto &engine : engines ){
+                bool ran = runHeadless( engine.options + options, filter, "in.ppm", "out.ppm" ) && readInto( "out.ppm", output );
+                expect( filter + " " + border + " " + engine.name, ran, output, reference, engine.tolerance );
+            }
+        }
+    }
+
+    // fusing changes what the border band sees, so only the inside is compared
+    string pipeline = filters[0] + "," + filters[1];
+    loadPipeline( pipeline );
+    int reach = pipelineReach();
+    bool ran = runHeadless( "--method naive", pipeline, "in.ppm", "naive.ppm" ) && readInto( "naive.ppm", reference );
+    ran = ran && runHeadless( "--fuse", pipeline, "in.ppm", "out.ppm" ) && readInto( "out.ppm", output );
+    expect( pipeline + " fused", ran, output, reference, 1, reach );
+
+    // .raw outputs are written straight through a mapping, and in place
+    // they must not be truncated before they are read
+    string filter = filters[0];
+    ran = runHeadless( "--method direct", filter, "in.ppm", "direct.ppm" ) && readInto( "direct.ppm", reference );
+    ran = ran && runHeadless( "--method direct", filter, "in.ppm", "out.raw" ) && readInto( "out.raw", output );
+    expect( filter + " raw output", ran, output, reference, 0 );
+    copyFile( "in.raw", "inplace.raw" );
+    ran = runHeadless( "--method direct", filter, "inplace.raw", "inplace.raw" ) && readInto( "inplace.raw", output );
+    expect( filter + " raw in place", ran, output, reference, 0 );
+
+    // the first run compiles into the cache, the second reads it back
+    string cache = "--method direct --kernel-cache " + checkDIR + "/cache";
+    ran = runHeadless( cache, filter, "in.ppm", "out.ppm" ) && readInto( "out.ppm", output );
+    expect( filter + " kernel cache cold", ran, output, reference, 0 );
+    ran = runHeadless( cache, filter, "in.ppm", "out.ppm" ) && readInto( "out.ppm", output );
+    expect( filter + " kernel cache warm", ran, output, reference, 0 );
+
+    // streaming goes through OpenImageIO scanlines
+    ran = runHeadless( "--method direct", filter, "in.png", "direct.png" ) && readInto( "direct.png", reference );
+    ran = ran && runHeadless( "--stream --method direct", filter, "in.png", "out.png" ) && readInto( "out.png", output );
+    expect( filter + " stream", ran, output, reference, 1 );
+
+    cout << checkCASES - checkFAILURES << " of " << checkCASES << " cases pass" << endl;
+    return( checkFAILURES > 0 ? 1 : 0 );
+}
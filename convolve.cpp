@@ -11,22 +11,151 @@
 #include "functions.h"
 
 int main( int argc, char* argv[] ){
-    if( argc > 4 ){
+    bool headless = false;
+    bool validate = false;
+    string socket_path = "";
+
+    // leading options
+    int arg = 1;
+    while( arg < argc && string( argv[arg] ).compare( 0, 2, "--" ) == 0 ){
+        string option = argv[arg++];
+        if( option == "--headless" ) headless = true;
+        else if( option == "--stream" ) headless = STREAM = true;
+        else if( option == "--fuse" ) FUSE = true;
+        else if( option == "--validate" ) validate = true;
+        else if( option == "--serve" && arg < argc ) socket_path = argv[arg++];
+        else if( option == "--kernel-cache" && arg < argc ) KERNEL_CACHE = argv[arg++];
+        else if( option == "--border" && arg < argc ){
+            if( !parseBorder( argv[arg++], BORDER ) ){
+                cout << "Command Line Error: --border takes zero, clamp, mirror or wrap! Exiting..." << endl;
+                return( 0 );
+            }
+            BORDER_OVERRIDE = true;
+        }
+        else if( option == "--palette-grid" && arg < argc ){
+            // columns x rows, e.g. 4x4
+            if( sscanf( argv[arg++], "%dx%d", &paletteCOLUMNS, &paletteROWS ) != 2 || paletteCOLUMNS < 1 || paletteROWS < 1 ){
+                cout << "Command Line Error: --palette-grid takes COLUMNSxROWS! Exiting..." << endl;
+                return( 0 );
+            }
+        }
+        else if( option == "--trace" && arg < argc ){
+            TRACE_FILE = argv[arg++];
+#ifndef PROFILE
+            cout << "Warning: built without PROFILE, no trace will be written" << endl;
+#endif
+        }
+        else if( option == "--threads" && arg < argc ){
+            THREADS = atoi( argv[arg++] );
+            if( THREADS < 1 ){
+                cout << "Command Line Error: --threads needs a positive count! Exiting..." << endl;
+                return( 0 );
+            }
+        }
+        else if( option == "--simd" && arg < argc ){
+            string level = argv[arg++];
+            if( level == "scalar" ) SIMD_LIMIT = SIMD_SCALAR;
+            else if( level == "sse" ) SIMD_LIMIT = SIMD_SSE;
+            else if( level == "avx2" ) SIMD_LIMIT = SIMD_AVX2;
+            else {
+                cout << "Command Line Error: --simd takes scalar, sse or avx2! Exiting..." << endl;
+                return( 0 );
+            }
+        }
+        else if( option == "--method" && arg < argc ){
+            string method = argv[arg++];
+            if( method == "auto" ) METHOD = METHOD_AUTO;
+            else if( method == "naive" ) METHOD = METHOD_NAIVE;
+            else if( method == "direct" ) METHOD = METHOD_DIRECT;
+            else if( method == "separable" ) METHOD = METHOD_SEPARABLE;
+            else if( method == "fft" ) METHOD = METHOD_FFT;
+            else if( method == "box" ) METHOD = METHOD_BOX;
+            else if( method == "fixed" ) METHOD = METHOD_FIXED;
+            else {
+                cout << "Command Line Error: --method takes auto, naive, direct, separable, fft, box or fixed! Exiting..." << endl;
+                return( 0 );
+            }
+        }
+        else {
+            cout << "Command Line Error: Unknown option " << option << "! Exiting..." << endl;
+            return( 0 );
+        }
+    }
+
+    if( !socket_path.empty() ){
+        // convolve --serve socket, jobs then come in over the socket
+        if( arg != argc ){
+            cout << "Command Line Error: --serve takes no other args! Exiting..." << endl;
+            return( 0 );
+        }
+        serve( socket_path );
+        return( 0 );
+    }
+
+    if( headless ){
+        // convolve [--headless] filter in1 out1 [in2 out2 ...]
+        if( argc - arg < 3 || ( argc - arg - 1 ) % 2 != 0 ){
+            cout << "Command Line Error: Headless mode needs a filter and input/output pairs! Exiting..." << endl;
+            return( 0 );
+        }
+
+        // the filters are only parsed once for the whole batch
+        loadPipeline( argv[arg] );
+        if( STREAM && PIPELINE.size() > 1 ){
+            cout << "Command Line Error: --stream takes a single filter! Exiting..." << endl;
+            return( 0 );
+        }
+        if( STREAM && ( METHOD == METHOD_FFT || METHOD == METHOD_BOX || METHOD == METHOD_FIXED ) ){
+            cout << "Command Line Error: --stream only runs the direct and separable methods! Exiting..." << endl;
+            return( 0 );
+        }
+
+        for( int i=arg+1; i<argc; i+=2 ){
+            if( STREAM ){
+                // never holds more than a kernel's height of rows
+                cout << argv[i] << " -> " << argv[i+1] << " (stream)" << endl;
+                streamConvolve( argv[i], argv[i+1] );
+                continue;
+            }
+            readImage( argv[i] );
+            cout << argv[i] << " -> " << argv[i+1] << " (" << pipelineMethods( imWIDTH, imHEIGHT ) << ", " << simdName( simdLevel() ) << ")" << endl;
+            // the last stage writes straight into the mapped file, unless
+            // that file is the input: truncating it would zero the pages
+            // the convolution reads
+            if( isRawFile( argv[i+1] ) && !validate && !sameFile( argv[i], argv[i+1] ) ){
+                convolveToFile( argv[i+1] );
+                destroy();
+                continue;
+            }
+            convolve();
+            if( validate ){
+                // against the floating point reference on the untouched original
+                long long differing;
+                int deviation = validatePipeline( ORIGINAL.pixels, IN, imWIDTH, imHEIGHT, differing );
+                cout << "  max deviation " << deviation << ", " << differing << " pixels differ" << endl;
+            }
+            writePixmap( argv[i+1], IN, imWIDTH, imHEIGHT );
+            destroy();
+        }
+        return( 0 );
+    }
+
+    if( argc - arg > 3 ){
         cout << "Command Line Error: Too many args! Exiting..." << endl;
         return( 0 );
     }
-    if( argc < 3 ){
+    if( argc - arg < 2 ){
         cout << "Command Line Error: Missing args! Exiting..." << endl;
         return( 0 );
     }
 
-    parseFilter( argv[1] );
-    normalizeFilter();
-    flipKernel();
+    loadPipeline( argv[arg] );
 
-    readImage( argv[2] );
+    // the window previews convolutions on a smaller level of the image first
+    PROGRESSIVE = true;
+    readImage( argv[arg+1] );
 
-    if( argc == 4 ) output_filename = argv[3];
+    if( argc - arg == 3 ) output_filename = argv[arg+2];
     else output_filename = "";
 
     glutInit( &argc, argv );
@@ -37,6 +166,7 @@ int main( int argc, char* argv[] ){
     glutDisplayFunc( handleDisplay );
     glutKeyboardFunc( handleKey );
     glutReshapeFunc( handleReshape );
+    glutMouseFunc( handleMouseClick );
 
     glutMainLoop();
     return( 0 );
@@ -0,0 +1,269 @@
+/*
+    The window's copy of the image.
+
+    IN is kept in a texture that is drawn over the viewport on every
+    redisplay. Whatever changes IN marks the rectangle it changed as STALE,
+    and only that rectangle is uploaded again, with glTexSubImage2D, so
+    showing an edit costs the driver the size of the edit rather than that
+    of the image. Images larger than the driver takes as a texture, and
+    drivers that refuse one of the image's size, are drawn with
+    glDrawPixels as before.
+
+    Where the driver has pixel buffer objects, the rectangle is copied into
+    one of two of them and the texture is filled from there. The copy into
+    the buffer is an ordinary memcpy and is done before the call returns;
+    only the move from the buffer into the texture is left to the driver,
+    which may finish it after glTexSubImage2D has returned. The two buffers
+    take turns, so the one being filled is never the one the driver may
+    still be reading from.
+
+    The time each frame takes is kept in FRAME and shown in the window
+    title, a few times a second rather than on every frame.
+*/
+
+/*
+    A rectangle of image pixels, [x0, x1) x [y0, y1), empty when x0 >= x1
+    or y0 >= y1.
+*/
+struct Rect{
+    int x0, y0, x1, y1;
+};
+
+// the part of IN the texture does not show yet
+Rect STALE = { 0, 0, 0, 0 };
+
+// the texture, the size it was made for, and whether the driver refused it
+GLuint TEXTURE = 0;
+int textureWIDTH = 0, textureHEIGHT = 0;
+bool textureFAILED = false;
+
+// the two pixel buffers, the bytes each holds, and the one filled last.
+// pixelBUFFERS is 1 if the driver has them, 0 if not, -1 until checked
+GLuint UNPACK[2] = { 0, 0 };
+size_t unpackSIZE[2] = { 0, 0 };
+int unpackLAST = 0;
+int pixelBUFFERS = -1;
+
+// time the display callback took for the last frame and on average, in
+// milliseconds, the frames drawn so far, and when the title last changed
+struct FrameTimes{
+    double last, average;
+    long long count;
+    chrono::steady_clock::time_point titled;
+};
+FrameTimes FRAME = { 0, 0, 0, chrono::steady_clock::time_point() };
+
+/*
+    Rectangle helpers: the empty one, the whole image, whether one is empty,
+    the smallest one holding both a and b, r grown by margin on every side,
+    and r cut down to the image.
+*/
+Rect emptyRect();
+Rect imageRect();
+bool isEmpty( const Rect& r );
+Rect unite( const Rect& a, const Rect& b );
+Rect grow( const Rect& r, int margin );
+Rect clipToImage( const Rect& r );
+
+/*
+    Records that IN changed inside r.
+*/
+void markStale( const Rect& r );
+
+/*
+    Brings the texture up to date with IN. Returns false if the image cannot
+    be shown as a texture.
+*/
+bool updateTexture();
+
+/*
+    Whether the driver has pixel buffer objects, from OpenGL 2.1 or
+    GL_ARB_pixel_buffer_object.
+*/
+bool hasPixelBuffers();
+
+/*
+    Sends the STALE rectangle of IN to the bound texture through the next
+    pixel buffer. Returns false, having sent nothing, if the buffer cannot
+    be mapped.
+*/
+bool uploadThroughBuffer();
+
+/*
+    Records a frame whose display callback started at start, and shows the
+    frame time in the window title at most four times a second.
+*/
+void countFrame( chrono::steady_clock::time_point start );
+
+/*
+    Draws IN over the viewport, through the texture when possible.
+*/
+void drawImage();
+
+
+Rect emptyRect(){
+    Rect r = { 0, 0, 0, 0 };
+    return r;
+}
+
+Rect imageRect(){
+    Rect r = { 0, 0, imWIDTH, imHEIGHT };
+    return r;
+}
+
+bool isEmpty( const Rect& r ){
+    return r.x0 >= r.x1 || r.y0 >= r.y1;
+}
+
+Rect unite( const Rect& a, const Rect& b ){
+    if( isEmpty( a ) ) return b;
+    if( isEmpty( b ) ) return a;
+    Rect r = { min( a.x0, b.x0 ), min( a.y0, b.y0 ), max( a.x1, b.x1 ), max( a.y1, b.y1 ) };
+    return r;
+}
+
+Rect grow( const Rect& r, int margin ){
+    if( isEmpty( r ) ) return r;
+    Rect grown = { r.x0 - margin, r.y0 - margin, r.x1 + margin, r.y1 + margin };
+    return grown;
+}
+
+Rect clipToImage( const Rect& r ){
+    Rect clipped = { max( r.x0, 0 ), max( r.y0, 0 ), min( r.x1, imWIDTH ), min( r.y1, imHEIGHT ) };
+    return isEmpty( clipped ) ? emptyRect() : clipped;
+}
+
+void markStale( const Rect& r ){
+    STALE = clipToImage( unite( STALE, r ) );
+}
+
+bool updateTexture(){
+    if( textureFAILED ) return false;
+    if( TEXTURE == 0 ) glGenTextures( 1, &TEXTURE );
+    glBindTexture( GL_TEXTURE_2D, TEXTURE );
+
+    if( textureWIDTH != imWIDTH || textureHEIGHT != imHEIGHT ){
+        GLint largest = 0;
+        glGetIntegerv( GL_MAX_TEXTURE_SIZE, &largest );
+        if( imWIDTH > largest || imHEIGHT > largest ) return false;
+
+        // nearest texels, so the texture looks the same as glDrawPixels did
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+        while( glGetError() != GL_NO_ERROR );
+        glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, imWIDTH, imHEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL );
+        if( glGetError() != GL_NO_ERROR ){
+            // e.g. no non power of two textures, this driver gets glDrawPixels
+            glDeleteTextures( 1, &TEXTURE );
+            TEXTURE = 0;
+            textureFAILED = true;
+            return false;
+        }
+        textureWIDTH = imWIDTH;
+        textureHEIGHT = imHEIGHT;
+        STALE = imageRect();
+    }
+
+    if( !isEmpty( STALE ) ){
+        PROFILE_SCOPE( "upload" );
+        glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+        if( !hasPixelBuffers() || !uploadThroughBuffer() ){
+            // the rows of IN are contiguous, so any rectangle of it is one upload
+            glPixelStorei( GL_UNPACK_ROW_LENGTH, imWIDTH );
+            glTexSubImage2D( GL_TEXTURE_2D, 0, STALE.x0, STALE.y0, STALE.x1 - STALE.x0, STALE.y1 - STALE.y0,
+                             GL_RGBA, GL_UNSIGNED_BYTE, &IN[STALE.y0][STALE.x0] );
+            glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
+        }
+        PROFILE_COUNT( COUNT_BYTES_UPLOADED, (long long)( STALE.x1 - STALE.x0 ) * ( STALE.y1 - STALE.y0 ) * sizeof( Pixel ) );
+        STALE = emptyRect();
+    }
+    return true;
+}
+
+bool hasPixelBuffers(){
+    if( pixelBUFFERS < 0 ){
+        int major = 0, minor = 0;
+        const char* version = ( const char* )glGetString( GL_VERSION );
+        const char* extensions = ( const char* )glGetString( GL_EXTENSIONS );
+        if( version ) sscanf( version, "%d.%d", &major, &minor );
+        pixelBUFFERS = major > 2 || ( major == 2 && minor >= 1 )
+            || ( extensions && strstr( extensions, "GL_ARB_pixel_buffer_object" ) );
+    }
+    return pixelBUFFERS == 1;
+}
+
+bool uploadThroughBuffer(){
+    int width = STALE.x1 - STALE.x0, height = STALE.y1 - STALE.y0;
+    size_t bytes = ( size_t )width * height * sizeof( Pixel );
+
+    int next = 1 - unpackLAST;
+    if( UNPACK[next] == 0 ) glGenBuffers( 1, &UNPACK[next] );
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, UNPACK[next] );
+    // buffers only grow, so that mapping one does not reallocate it
+    if( unpackSIZE[next] < bytes ){
+        glBufferData( GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW );
+        unpackSIZE[next] = bytes;
+    }
+    Pixel* mapped = ( Pixel* )glMapBuffer( GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY );
+    if( !mapped ){
+        glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+        return false;
+    }
+
+    // packed tight, the buffer holds the rectangle and nothing else
+    for( int y=0; y<height; y++ )
+        memcpy( mapped + ( size_t )y * width, &IN[STALE.y0 + y][STALE.x0], width * sizeof( Pixel ) );
+    bool unmapped = glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+    // with a buffer bound, the pointer is an offset into it
+    if( unmapped ) glTexSubImage2D( GL_TEXTURE_2D, 0, STALE.x0, STALE.y0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL );
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+    unpackLAST = next;
+    return unmapped;
+}
+
+void countFrame( chrono::steady_clock::time_point start ){
+    FRAME.last = chrono::duration<double, milli>( chrono::steady_clock::now() - start ).count();
+    // the average follows the last few dozen frames
+    FRAME.average = FRAME.count == 0 ? FRAME.last : 0.95 * FRAME.average + 0.05 * FRAME.last;
+    FRAME.count++;
+
+    // setting the title is a round trip to the window system, not worth
+    // paying on every frame of a drag
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if( FRAME.count > 1 && now - FRAME.titled < chrono::milliseconds( 250 ) ) return;
+    FRAME.titled = now;
+    char title[64];
+    snprintf( title, sizeof( title ), "CONVOLVE - %.1f ms/frame, %.1f average", FRAME.last, FRAME.average );
+    glutSetWindowTitle( title );
+}
+
+void drawImage(){
+    if( updateTexture() ){
+        // the viewport is the size of the image, or the image scaled down
+        // to fit the window, and its coordinates are pixels
+        glEnable( GL_TEXTURE_2D );
+        glTexEnvi( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE );
+        glBegin( GL_QUADS );
+        glTexCoord2f( 0, 0 ); glVertex2i( 0, 0 );
+        glTexCoord2f( 1, 0 ); glVertex2i( vpWIDTH, 0 );
+        glTexCoord2f( 1, 1 ); glVertex2i( vpWIDTH, vpHEIGHT );
+        glTexCoord2f( 0, 1 ); glVertex2i( 0, vpHEIGHT );
+        glEnd();
+        glDisable( GL_TEXTURE_2D );
+        return;
+    }
+
+    // if the window is smaller than the image, scale it down, otherwise do not scale
+    if(winWIDTH < imWIDTH  || winHEIGHT < imHEIGHT)
+        glPixelZoom(float(vpWIDTH) / imWIDTH, float(vpHEIGHT) / imHEIGHT);
+    else
+        glPixelZoom(1.0, 1.0);
+
+    // display starting at the lower lefthand corner of the viewport
+    glRasterPos2i(0, 0);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glDrawPixels(imWIDTH, imHEIGHT, pixel_format, GL_UNSIGNED_BYTE, IN[0]);
+}
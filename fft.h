@@ -0,0 +1,105 @@
+/*
+    Self contained radix-2 fast Fourier transform, used to convolve with
+    large kernels.
+*/
+#include <complex>
+
+typedef complex<float> Complex;
+
+/*
+    Bit reversal permutation and twiddle factors for transforms of one
+    power of two size. Built once and shared read only between threads.
+*/
+struct FFTPlan{
+    int n;
+    vector<int> reversed;
+    vector<Complex> twiddles;
+
+    void build( int size );
+};
+
+/*
+    Returns the smallest power of two that is at least n.
+*/
+int nextPowerOfTwo( int n );
+
+/*
+    Complex product, written out so it does not go through the slow inf/nan
+    checking path of operator*.
+*/
+inline Complex multiply( const Complex& a, const Complex& b ){
+    return Complex( a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real() );
+}
+
+/*
+    In place transform of plan.n contiguous values. The inverse transform is
+    not scaled by 1/n.
+*/
+void fft( const FFTPlan& plan, Complex* data, bool inverse );
+
+/*
+    In place transform of an n x n row major block, rows then columns.
+    The inverse transform is not scaled by 1/n^2.
+*/
+void fft2d( const FFTPlan& plan, Complex* data, bool inverse );
+
+
+int nextPowerOfTwo( int n ){
+    int power = 1;
+    while( power < n ) power *= 2;
+    return power;
+}
+
+void FFTPlan::build( int size ){
+    n = size;
+    int levels = 0;
+    while( ( 1 << levels ) < n ) levels++;
+
+    reversed.resize( n );
+    for( int i=0; i<n; i++ ){
+        int r = 0;
+        for( int bit=0; bit<levels; bit++ )
+            if( i & ( 1 << bit ) ) r |= 1 << ( levels - 1 - bit );
+        reversed[i] = r;
+    }
+
+    twiddles.resize( n / 2 );
+    for( int k=0; k<n/2; k++ ){
+        double angle = -2.0 * M_PI * k / n;
+        twiddles[k] = Complex( cos( angle ), sin( angle ) );
+    }
+}
+
+void fft( const FFTPlan& plan, Complex* data, bool inverse ){
+    int n = plan.n;
+    for( int i=0; i<n; i++ ){
+        int j = plan.reversed[i];
+        if( i < j ) swap( data[i], data[j] );
+    }
+
+    for( int size=2; size<=n; size*=2 ){
+        int half = size / 2;
+        int step = n / size;
+        for( int start=0; start<n; start+=size )
+            for( int k=0; k<half; k++ ){
+                Complex w = plan.twiddles[k * step];
+                if( inverse ) w = conj( w );
+                Complex t = multiply( w, data[start + k + half] );
+                data[start + k + half] = data[start + k] - t;
+                data[start + k] += t;
+            }
+    }
+}
+
+void fft2d( const FFTPlan& plan, Complex* data, bool inverse ){
+    int n = plan.n;
+    for( int y=0; y<n; y++ ) fft( plan, data + y * n, inverse );
+
+    // columns are gathered into a contiguous line so the butterflies stay in cache
+    vector<Complex> column( n );
+    for( int x=0; x<n; x++ ){
+        for( int y=0; y<n; y++ ) column[y] = data[y * n + x];
+        fft( plan, &column[0], inverse );
+        for( int y=0; y<n; y++ ) data[y * n + x] = column[y];
+    }
+}
@@ -0,0 +1,986 @@
+/*
+    Convolution kernel loading and filtering of Pixel buffers.
+
+    The kernel is stored as a flat kernelSIZE x kernelSIZE array of weights,
+    row major, in the order it is applied to the image.
+*/
+
+// edge length of the square tiles the image is split into for the threads
+const int TILE_SIZE = 64;
+
+int kernelSIZE = 0;
+int kernelRADIUS = 0;
+vector<float> KERNEL;
+
+// ways of applying the kernel. METHOD_AUTO lets the cost model pick, the
+// others are forced with --method
+enum ConvolveMethod{ METHOD_AUTO, METHOD_NAIVE, METHOD_DIRECT, METHOD_SEPARABLE, METHOD_FFT, METHOD_BOX, METHOD_FIXED };
+ConvolveMethod METHOD = METHOD_AUTO;
+
+// what taps that fall outside of the image read: zero, the nearest edge
+// pixel, the image mirrored about its edge pixels, or the opposite side
+enum BorderMode{ BORDER_ZERO, BORDER_CLAMP, BORDER_MIRROR, BORDER_WRAP };
+
+// border of the current kernel, from its .filt header or BORDER
+BorderMode kernelBORDER = BORDER_ZERO;
+
+// border of filters without a header. Set by --border, which then also
+// overrides the headers
+BorderMode BORDER = BORDER_ZERO;
+bool BORDER_OVERRIDE = false;
+
+// fractional bits of the 16 bit weights of METHOD_FIXED. Normalized weights
+// lie in [-1, 1], so 14 bits leave room for the sign
+const int FIXED_SHIFT = 14;
+
+// rank 1 kernels are also kept as a column and a row vector, whose outer
+// product gives back KERNEL
+bool kernelSEPARABLE = false;
+vector<float> kernelCOLUMN, kernelROW;
+
+// box and tent kernels are also kept as the widths of the boxes that, run
+// one after the other along each axis, give back KERNEL up to scale
+vector<int> kernelBOXES;
+
+// how each weight relates to its mirror image about the centre column
+// (horizontal), the centre row (vertical) and the centre (point): 1 if they
+// are all equal, -1 if they are all opposite, 0 otherwise. Mirrored taps
+// are then added or subtracted before a single multiply
+int kernelHSYMMETRY = 0, kernelVSYMMETRY = 0, kernelPSYMMETRY = 0;
+
+// border named by the header of the last .filt read, -1 if it had none
+int kernelHEADER = -1;
+
+/*
+    Reads the contents of a .filt file from in into the kernel globals: an
+    optional "border MODE" header, then the kernel size N followed by N*N
+    weights. Returns false, with the problem in error, if they are malformed.
+*/
+bool readKernel( istream& in, string& error );
+
+/*
+    Looks up a border mode by the name used by --border and .filt headers.
+    Returns false for unknown names.
+*/
+bool parseBorder( string name, BorderMode& mode );
+
+/*
+    Index that position i of a row or column of n pixels reads under
+    kernelBORDER, or -1 if it reads zero.
+*/
+inline int borderIndex( int i, int n ){
+    if( i >= 0 && i < n ) return i;
+    switch( kernelBORDER ){
+        case BORDER_CLAMP: return i < 0 ? 0 : n - 1;
+        case BORDER_MIRROR: {
+            if( n == 1 ) return 0;
+            int period = 2 * ( n - 1 );
+            i = abs( i ) % period;
+            return i < n ? i : period - i;
+        }
+        case BORDER_WRAP: return ( i % n + n ) % n;
+        default: return -1;
+    }
+}
+
+/*
+    Scales the kernel so that the larger of the sum of its positive weights
+    and the magnitude of the sum of its negative weights becomes 1.
+*/
+void normalizeFilter();
+
+/*
+    Checks whether the kernel is the outer product of a column and a row
+    vector, within a small tolerance, and if so records both vectors and
+    looks for boxes in them. Sets the symmetries too.
+*/
+void detectSeparable();
+
+/*
+    Checks whether the kernel is a constant box or a tent, the product of
+    two boxes of width ( kernelSIZE + 1 ) / 2, and if so records the widths
+    in kernelBOXES. Kernels too wide for 32 bit sums are left out.
+*/
+void detectBoxes();
+
+/*
+    Flips the kernel so it can be applied by correlation.
+*/
+void flipKernel();
+
+/*
+    Splits a width x height image into TILE_SIZE tiles and runs
+    task( x0, y0, x1, y1 ) for each of them on the thread pool.
+*/
+void forEachTile( int width, int height, const function<void( int, int, int, int )>& task, int tile = TILE_SIZE );
+
+/*
+    Convolves the pixels [x0, x1) x [y0, y1) of src into dst. Taps reach
+    into the surrounding kernelRADIUS halo of src, so tiles can be done in
+    any order and on any thread with the same result.
+*/
+void convolveRegion( Pixel** src, Pixel** dst, int width, int height, int x0, int y0, int x1, int y1 );
+
+/*
+    Convolves the rgb channels of src into dst with the current kernel.
+    Alpha is copied through unchanged. Taps that fall outside of the image
+    follow kernelBORDER.
+*/
+void convolveImage( Pixel** src, Pixel** dst, int width, int height );
+
+/*
+    Planar copy of the rgb channels of an image: one plane per channel,
+    surrounded by a border pad pixels wide, so the inner loops can run over
+    whole row segments without bounds checks. The border is zero until
+    fillBorder fills it in. The float planes
+    feed the floating point paths, the int ones the fixed point path.
+
+    The storage comes from BUFFERS. Rows are stride elements apart, padded
+    to a multiple of BUFFER_ALIGN bytes and offset so that the first pixel
+    of every row is aligned, like the tiles the loops start from.
+*/
+template<typename T>
+struct PlanesOf{
+    int width, height, pad, stride, origin;
+    Buffer<T> data;
+
+    void resize( int w, int h, int p );
+    T* row( int channel, int y );
+};
+typedef PlanesOf<float> Planes;
+typedef PlanesOf<short> FixedPlanes;
+
+/*
+    Copies the rgb channels of src into planes, which must already be sized.
+*/
+template<typename T>
+void toPlanes( Pixel** src, PlanesOf<T>& planes );
+
+/*
+    Fills the border of planes from their inside following kernelBORDER,
+    so only this thin band ever deals with the edges.
+*/
+template<typename T>
+void fillBorder( PlanesOf<T>& planes );
+
+/*
+    Clamps n accumulated rgb values into dst row y, starting at x0. Alpha is
+    taken from src.
+*/
+void storeRow( float acc[3][TILE_SIZE], Pixel** src, Pixel** dst, int y, int x0, int n );
+
+/*
+    One multiply-add of the direct path over a row segment: weight times the
+    line lines[row] from column on, plus or minus (sign) the mirrored tap at
+    mirrorRow and mirrorColumn, or on its own when sign is 0.
+*/
+struct Tap{
+    int row, column, mirrorRow, mirrorColumn, sign;
+    float weight;
+};
+
+/*
+    The non-zero taps of the current kernel in the order the direct path
+    applies them, with mirrored taps folded into one. A vertically symmetric
+    or antisymmetric kernel has its mirrored rows pre-added or subtracted
+    into lines, so only rows of them are left: the top half, and the centre
+    row unless the kernel is antisymmetric. Horizontal symmetry then folds
+    the taps of each row, and point symmetry is used when there is neither.
+*/
+vector<Tap> foldedTaps( int& rows );
+
+/*
+    Number of taps a row or column vector of the separable path is left with
+    once folded by sign.
+*/
+int foldedLength( int sign );
+
+/*
+    Same results as convolveImage, up to the rounding of the folded taps,
+    computed on a planar copy of src with the vectorized row loops from
+    simd.h, the second one in a row pass and a column pass.
+*/
+void convolvePlanar( Pixel** src, Pixel** dst, int width, int height );
+void convolvePlanarSeparable( Pixel** src, Pixel** dst, int width, int height );
+
+/*
+    Rounds the kernel to FIXED_SHIFT fixed point weights. The rounding errors
+    are carried from weight to weight, so the weights still add up to the
+    rounded sum and flat areas stay exact.
+*/
+void quantizeKernel( vector<short>& weights );
+
+/*
+    Same as convolvePlanar in 16 bit fixed point weights with int32 sums.
+    The pixels are kept as 16 bit planes, and the taps of kernel rows i and
+    i + 1 go through one AxpyFixedRow call. Each channel becomes
+    ( sum + half ) >> FIXED_SHIFT, clamped to [0, 255], so the output is the
+    same on every machine and instruction set.
+*/
+void convolveFixed( Pixel** src, Pixel** dst, int width, int height );
+
+/*
+    Running sum of the n values in[0], in[step], ... over the window
+    [i - radius, i + radius] into out[i * step], counting values outside of
+    [0, n) as zero. Integer sums make the result exact whatever the radius.
+*/
+void boxLine( const unsigned int* in, unsigned int* out, int n, int radius, int step );
+
+/*
+    Same as boxLine down the n columns of a strip of rows rows, stride
+    apart, so the running sums of neighbouring columns vectorize.
+*/
+void boxColumns( const unsigned int* in, unsigned int* out, int rows, int stride, int n, int radius );
+
+/*
+    Convolves with the running sums of kernelBOXES, first along the rows
+    and then down the columns. The cost per pixel depends on the number of
+    boxes only, not on their width.
+*/
+void convolveBox( Pixel** src, Pixel** dst, int width, int height );
+
+/*
+    Convolves with the FFT: the image is cut into blocks of block - 2 *
+    kernelRADIUS pixels, and each block plus its halo is transformed,
+    multiplied with the kernel spectrum and transformed back. Red and green
+    share one complex transform as its real and imaginary parts.
+*/
+void convolveFFT( Pixel** src, Pixel** dst, int width, int height, int block );
+
+/*
+    Estimated work, in multiply-adds per pixel, of each method on a width x
+    height image with the current kernel. The vectorized paths are credited
+    with the simd width. block receives the cheapest FFT block size.
+*/
+float directCost();
+float separableCost();
+float boxCost();
+float fftCost( int width, int height, int& block );
+
+/*
+    Picks the method to use for a width x height image: the forced METHOD, or
+    the cheapest one by the cost model. Forcing separable on a kernel that is
+    not separable, or box on one without boxes, falls back to direct.
+*/
+ConvolveMethod chooseMethod( int width, int height );
+
+/*
+    Name of a method, as accepted by --method.
+*/
+string methodName( ConvolveMethod method );
+
+/*
+    Multiply-adds a method spends on a width x height image, for the
+    profiling counters. The FFT figure is the cost model's estimate.
+*/
+long long kernelMACs( ConvolveMethod method, int width, int height );
+
+/*
+    Convolves src into dst with the method chooseMethod picks.
+*/
+void applyKernel( Pixel** src, Pixel** dst, int width, int height );
+
+// clamps a filtered channel value into the displayable range
+inline unsigned char clampChannel( float value ){
+    if( value <= 0.0f ) return 0;
+    if( value >= 255.0f ) return 255;
+    return ( unsigned char )( value + 0.5f );
+}
+
+
+bool readKernel( istream& in, string& error ){
+    kernelBORDER = BORDER;
+    kernelHEADER = -1;
+    in >> ws;
+    if( isalpha( in.peek() ) ){
+        string header, mode;
+        BorderMode border;
+        if( !( in >> header >> mode ) || header != "border" || !parseBorder( mode, border ) ){
+            error = "Invalid header";
+            return false;
+        }
+        kernelHEADER = border;
+        if( !BORDER_OVERRIDE ) kernelBORDER = border;
+    }
+
+    if( !( in >> kernelSIZE ) || kernelSIZE < 1 || kernelSIZE % 2 == 0 ){
+        error = "Invalid kernel size";
+        return false;
+    }
+    kernelRADIUS = kernelSIZE / 2;
+
+    KERNEL.assign( kernelSIZE * kernelSIZE, 0.0f );
+    for( int i=0; i<kernelSIZE*kernelSIZE; i++ ){
+        if( !( in >> KERNEL[i] ) ){
+            error = "Missing kernel weights";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parseBorder( string name, BorderMode& mode ){
+    if( name == "zero" ) mode = BORDER_ZERO;
+    else if( name == "clamp" ) mode = BORDER_CLAMP;
+    else if( name == "mirror" ) mode = BORDER_MIRROR;
+    else if( name == "wrap" ) mode = BORDER_WRAP;
+    else return false;
+    return true;
+}
+
+void normalizeFilter(){
+    float positive = 0.0f;
+    float negative = 0.0f;
+    for( auto &weight : KERNEL ){
+        if( weight > 0 ) positive += weight;
+        else negative -= weight;
+    }
+
+    float scale = max( positive, negative );
+    if( scale != 0.0f )
+        for( auto &weight : KERNEL ) weight /= scale;
+
+    detectSeparable();
+}
+
+void detectSeparable(){
+    kernelSEPARABLE = false;
+    kernelCOLUMN.clear();
+    kernelROW.clear();
+    kernelBOXES.clear();
+
+    // exact comparisons, so folded taps give the same sums up to rounding
+    bool symmetric[3] = { true, true, true }, antisymmetric[3] = { true, true, true };
+    for( int i=0; i<kernelSIZE; i++ )
+        for( int j=0; j<kernelSIZE; j++ ){
+            float weight = KERNEL[i * kernelSIZE + j];
+            float mirrors[3] = { KERNEL[i * kernelSIZE + kernelSIZE - 1 - j], KERNEL[( kernelSIZE - 1 - i ) * kernelSIZE + j],
+                                 KERNEL[( kernelSIZE - 1 - i ) * kernelSIZE + kernelSIZE - 1 - j] };
+            for( int m=0; m<3; m++ ){
+                if( weight != mirrors[m] ) symmetric[m] = false;
+                if( weight != -mirrors[m] ) antisymmetric[m] = false;
+            }
+        }
+    int* symmetries[3] = { &kernelHSYMMETRY, &kernelVSYMMETRY, &kernelPSYMMETRY };
+    for( int m=0; m<3; m++ ) *symmetries[m] = symmetric[m] ? 1 : antisymmetric[m] ? -1 : 0;
+
+    // pivot on the largest weight, so the factors are well conditioned
+    int pivot = 0;
+    for( int i=1; i<kernelSIZE*kernelSIZE; i++ )
+        if( fabs( KERNEL[i] ) > fabs( KERNEL[pivot] ) ) pivot = i;
+    float largest = fabs( KERNEL[pivot] );
+    if( largest == 0.0f ) return;
+
+    // column through the pivot, and the pivot row scaled so the pivot is 1
+    int prow = pivot / kernelSIZE;
+    int pcol = pivot % kernelSIZE;
+    vector<float> column( kernelSIZE ), row( kernelSIZE );
+    for( int i=0; i<kernelSIZE; i++ ){
+        column[i] = KERNEL[i * kernelSIZE + pcol];
+        row[i] = KERNEL[prow * kernelSIZE + i] / KERNEL[pivot];
+    }
+
+    // every weight has to be reproduced by the outer product
+    const float tolerance = 1e-5f * largest;
+    for( int i=0; i<kernelSIZE; i++ )
+        for( int j=0; j<kernelSIZE; j++ )
+            if( fabs( KERNEL[i * kernelSIZE + j] - column[i] * row[j] ) > tolerance ) return;
+
+    kernelSEPARABLE = true;
+    kernelCOLUMN = column;
+    kernelROW = row;
+    detectBoxes();
+}
+
+void detectBoxes(){
+    kernelBOXES.clear();
+    float centre = KERNEL[kernelRADIUS * kernelSIZE + kernelRADIUS];
+    if( centre == 0.0f ) return;
+
+    // one box as wide as the kernel, or two half as wide making a tent.
+    // Boxes have odd widths so they stay centred
+    vector<vector<int>> candidates = { { kernelSIZE } };
+    int half = ( kernelSIZE + 1 ) / 2;
+    if( kernelSIZE > 1 && half % 2 == 1 ) candidates.push_back( { half, half } );
+
+    float largest = 0.0f;
+    for( auto &weight : KERNEL ) largest = max( largest, fabs( weight ) );
+    const float tolerance = 1e-5f * largest;
+
+    for( auto &boxes : candidates ){
+        // the sums reach 255 times the square of the product of the widths
+        long long count = 1;
+        for( auto &box : boxes ) count *= box;
+        if( 255.0 * count * count >= 4294967296.0 ) continue;
+
+        // profile of the boxes along one axis: their response to a single 1
+        vector<float> profile( kernelSIZE, 0.0f ), next( kernelSIZE );
+        profile[kernelRADIUS] = 1.0f;
+        for( auto &box : boxes ){
+            for( int x=0; x<kernelSIZE; x++ ){
+                next[x] = 0.0f;
+                for( int d=-box/2; d<=box/2; d++ )
+                    if( x + d >= 0 && x + d < kernelSIZE ) next[x] += profile[x + d];
+            }
+            profile.swap( next );
+        }
+
+        float scale = centre / ( profile[kernelRADIUS] * profile[kernelRADIUS] );
+        bool matches = true;
+        for( int i=0; i<kernelSIZE && matches; i++ )
+            for( int j=0; j<kernelSIZE; j++ )
+                if( fabs( KERNEL[i * kernelSIZE + j] - scale * profile[i] * profile[j] ) > tolerance ) matches = false;
+        if( matches ){
+            kernelBOXES = boxes;
+            return;
+        }
+    }
+}
+
+void flipKernel(){
+    // convolution rotates the kernel by 180 degrees. IN also stores the bottom
+    // scanline first, so the rows are mirrored back again, which leaves only
+    // the columns reversed
+    for( int i=0; i<kernelSIZE; i++ )
+        reverse( KERNEL.begin() + i * kernelSIZE, KERNEL.begin() + ( i + 1 ) * kernelSIZE );
+    reverse( kernelROW.begin(), kernelROW.end() );
+}
+
+void forEachTile( int width, int height, const function<void( int, int, int, int )>& task, int tile ){
+    int columns = ( width + tile - 1 ) / tile;
+    int rows = ( height + tile - 1 ) / tile;
+    parallelFor( columns * rows, [&]( int index ){
+        int x0 = ( index % columns ) * tile;
+        int y0 = ( index / columns ) * tile;
+        task( x0, y0, min( x0 + tile, width ), min( y0 + tile, height ) );
+    });
+}
+
+void convolveRegion( Pixel** src, Pixel** dst, int width, int height, int x0, int y0, int x1, int y1 ){
+    float r, g, b, weight;
+    int row, col;
+    for( int y=y0; y<y1; y++ )
+        for( int x=x0; x<x1; x++ ){
+            r = g = b = 0.0f;
+            for( int i=0; i<kernelSIZE; i++ ){
+                row = borderIndex( y + i - kernelRADIUS, height );
+                if( row < 0 ) continue;
+                for( int j=0; j<kernelSIZE; j++ ){
+                    col = borderIndex( x + j - kernelRADIUS, width );
+                    if( col < 0 ) continue;
+                    weight = KERNEL[i * kernelSIZE + j];
+                    r += weight * src[row][col].r;
+                    g += weight * src[row][col].g;
+                    b += weight * src[row][col].b;
+                }
+            }
+            dst[y][x].r = clampChannel( r );
+            dst[y][x].g = clampChannel( g );
+            dst[y][x].b = clampChannel( b );
+            dst[y][x].a = src[y][x].a;
+        }
+}
+
+void convolveImage( Pixel** src, Pixel** dst, int width, int height ){
+    forEachTile( width, height, [&]( int x0, int y0, int x1, int y1 ){
+        convolveRegion( src, dst, width, height, x0, y0, x1, y1 );
+    });
+}
+
+template<typename T>
+void PlanesOf<T>::resize( int w, int h, int p ){
+    width = w;
+    height = h;
+    pad = p;
+    int align = BUFFER_ALIGN / sizeof( T );
+    origin = ( p + align - 1 ) / align * align;
+    stride = ( origin + w + p + align - 1 ) / align * align;
+    data.resize( ( size_t )3 * stride * ( h + 2 * p ) );
+    data.zero();
+}
+
+template<typename T>
+T* PlanesOf<T>::row( int channel, int y ){
+    return &data[( size_t )( channel * ( height + 2 * pad ) + y + pad ) * stride + origin];
+}
+
+template<typename T>
+void toPlanes( Pixel** src, PlanesOf<T>& planes ){
+    forEachTile( planes.width, planes.height, [&]( int x0, int y0, int x1, int y1 ){
+        for( int y=y0; y<y1; y++ ){
+            T* r = planes.row( 0, y );
+            T* g = planes.row( 1, y );
+            T* b = planes.row( 2, y );
+            for( int x=x0; x<x1; x++ ){
+                r[x] = src[y][x].r;
+                g[x] = src[y][x].g;
+                b[x] = src[y][x].b;
+            }
+        }
+    });
+}
+
+template<typename T>
+void fillBorder( PlanesOf<T>& planes ){
+    if( kernelBORDER == BORDER_ZERO || planes.pad == 0 ) return;
+    int pad = planes.pad;
+    for( int c=0; c<3; c++ ){
+        // the sides of the rows inside the image first, then whole padded
+        // rows above and below are copies of those
+        for( int y=0; y<planes.height; y++ ){
+            T* row = planes.row( c, y );
+            for( int x=-pad; x<0; x++ ) row[x] = row[borderIndex( x, planes.width )];
+            for( int x=planes.width; x<planes.width+pad; x++ ) row[x] = row[borderIndex( x, planes.width )];
+        }
+        for( int y=-pad; y<planes.height+pad; y++ ){
+            if( y >= 0 && y < planes.height ) continue;
+            const T* source = planes.row( c, borderIndex( y, planes.height ) ) - pad;
+            copy( source, source + planes.width + 2 * pad, planes.row( c, y ) - pad );
+        }
+    }
+}
+
+void storeRow( float acc[3][TILE_SIZE], Pixel** src, Pixel** dst, int y, int x0, int n ){
+    for( int k=0; k<n; k++ ){
+        dst[y][x0 + k].r = clampChannel( acc[0][k] );
+        dst[y][x0 + k].g = clampChannel( acc[1][k] );
+        dst[y][x0 + k].b = clampChannel( acc[2][k] );
+        dst[y][x0 + k].a = src[y][x0 + k].a;
+    }
+}
+
+vector<Tap> foldedTaps( int& rows ){
+    int hsign = kernelHSYMMETRY, vsign = kernelVSYMMETRY;
+    int psign = hsign == 0 && vsign == 0 ? kernelPSYMMETRY : 0;
+    int last = kernelSIZE - 1;
+    rows = vsign > 0 ? kernelRADIUS + 1 : vsign < 0 ? kernelRADIUS : kernelSIZE;
+
+    // zero taps would add nothing, skipping them keeps the result
+    vector<Tap> taps;
+    for( int i=0; i<rows; i++ )
+        for( int j=0; j<kernelSIZE; j++ ){
+            Tap tap = { i, j, i, j, 0, KERNEL[i * kernelSIZE + j] };
+            if( hsign != 0 ){
+                // the first half of the row, then its centre
+                if( j > kernelRADIUS ) continue;
+                if( j < kernelRADIUS ){
+                    tap.mirrorColumn = last - j;
+                    tap.sign = hsign;
+                }
+            } else if( psign != 0 ){
+                // everything above the centre row, and the left half of it
+                if( i > kernelRADIUS || ( i == kernelRADIUS && j > kernelRADIUS ) ) continue;
+                if( i < kernelRADIUS || j < kernelRADIUS ){
+                    tap.mirrorRow = last - i;
+                    tap.mirrorColumn = last - j;
+                    tap.sign = psign;
+                }
+            }
+            if( tap.weight != 0.0f ) taps.push_back( tap );
+        }
+    return taps;
+}
+
+int foldedLength( int sign ){
+    return sign > 0 ? kernelRADIUS + 1 : sign < 0 ? kernelRADIUS : kernelSIZE;
+}
+
+void convolvePlanar( Pixel** src, Pixel** dst, int width, int height ){
+    Planes planes;
+    planes.resize( width, height, kernelRADIUS );
+    toPlanes( src, planes );
+    fillBorder( planes );
+
+    int rows;
+    vector<Tap> taps = foldedTaps( rows );
+    int vsign = kernelVSYMMETRY;
+
+    // the common sizes have a routine specialized for them, which folds the
+    // row taps the same way, but knows nothing of point symmetry
+    bool pointFolded = kernelHSYMMETRY == 0 && vsign == 0 && kernelPSYMMETRY != 0;
+    FixedRow fixed = pointFolded ? NULL : fixedRowKernel( kernelSIZE, rows, kernelHSYMMETRY );
+    AxpyRow axpy = axpyRow();
+    FoldRow add = foldRow( 1 ), subtract = foldRow( -1 ), pair = foldRow( vsign );
+    forEachTile( width, height, [&]( int x0, int y0, int x1, int y1 ){
+        float acc[3][TILE_SIZE];
+        int n = x1 - x0;
+        int span = n + 2 * kernelRADIUS;
+        vector<const float*> lines( kernelSIZE );
+        vector<float> paired( vsign != 0 ? kernelRADIUS * span : 0 );
+        for( int y=y0; y<y1; y++ ){
+            for( int c=0; c<3; c++ ){
+                for( int i=0; i<kernelSIZE; i++ ) lines[i] = planes.row( c, y + i - kernelRADIUS ) + x0 - kernelRADIUS;
+                // row i and its mirror become one line, a fold with weight 1
+                for( int i=0; i<kernelRADIUS && vsign!=0; i++ ){
+                    float* line = &paired[i * span];
+                    fill( line, line + span, 0.0f );
+                    pair( line, lines[i], lines[kernelSIZE - 1 - i], 1.0f, span );
+                    lines[i] = line;
+                }
+
+                if( fixed ){
+                    fixed( acc[c], &lines[0], &KERNEL[0], n );
+                    continue;
+                }
+                fill( acc[c], acc[c] + n, 0.0f );
+                for( auto &tap : taps ){
+                    if( tap.sign == 0 ) axpy( acc[c], lines[tap.row] + tap.column, tap.weight, n );
+                    else ( tap.sign > 0 ? add : subtract )( acc[c], lines[tap.row] + tap.column, lines[tap.mirrorRow] + tap.mirrorColumn, tap.weight, n );
+                }
+            }
+            storeRow( acc, src, dst, y, x0, n );
+        }
+    });
+}
+
+void convolvePlanarSeparable( Pixel** src, Pixel** dst, int width, int height ){
+    Planes planes, temp;
+    planes.resize( width, height, kernelRADIUS );
+    temp.resize( width, height, kernelRADIUS );
+    toPlanes( src, planes );
+    fillBorder( planes );
+
+    // the row and column vectors are mirrored like the kernel they come
+    // from, so each tap of their first half is folded with its mirror
+    int hsign = kernelHSYMMETRY, vsign = kernelVSYMMETRY;
+    int last = kernelSIZE - 1;
+    AxpyRow axpy = axpyRow();
+    FoldRow hfold = foldRow( hsign ), vfold = foldRow( vsign );
+
+    // the horizontal pass accumulates straight into the zeroed temp planes
+    forEachTile( width, height, [&]( int x0, int y0, int x1, int y1 ){
+        int n = x1 - x0;
+        for( int y=y0; y<y1; y++ )
+            for( int c=0; c<3; c++ ){
+                const float* line = planes.row( c, y ) + x0 - kernelRADIUS;
+                float* sums = temp.row( c, y ) + x0;
+                for( int j=0; j<foldedLength( hsign ); j++ ){
+                    if( kernelROW[j] == 0.0f ) continue;
+                    if( hsign != 0 && j < kernelRADIUS ) hfold( sums, line + j, line + last - j, kernelROW[j], n );
+                    else axpy( sums, line + j, kernelROW[j], n );
+                }
+            }
+    });
+    // the vertical pass reads rows above and below the image
+    fillBorder( temp );
+
+    forEachTile( width, height, [&]( int x0, int y0, int x1, int y1 ){
+        float acc[3][TILE_SIZE];
+        int n = x1 - x0;
+        for( int y=y0; y<y1; y++ ){
+            for( int c=0; c<3; c++ ){
+                fill( acc[c], acc[c] + n, 0.0f );
+                for( int i=0; i<foldedLength( vsign ); i++ ){
+                    if( kernelCOLUMN[i] == 0.0f ) continue;
+                    const float* line = temp.row( c, y + i - kernelRADIUS ) + x0;
+                    if( vsign != 0 && i < kernelRADIUS ) vfold( acc[c], line, temp.row( c, y + kernelRADIUS - i ) + x0, kernelCOLUMN[i], n );
+                    else axpy( acc[c], line, kernelCOLUMN[i], n );
+                }
+            }
+            storeRow( acc, src, dst, y, x0, n );
+        }
+    });
+}
+
+void quantizeKernel( vector<short>& weights ){
+    // each weight is the difference of the rounded running sums, so every
+    // weight is off by less than one unit and the sum rounds exactly
+    weights.resize( KERNEL.size() );
+    double sum = 0.0;
+    long previous = 0;
+    for( size_t i=0; i<KERNEL.size(); i++ ){
+        sum += KERNEL[i] * double( 1 << FIXED_SHIFT );
+        long rounded = lround( sum );
+        weights[i] = rounded - previous;
+        previous = rounded;
+    }
+}
+
+void convolveFixed( Pixel** src, Pixel** dst, int width, int height ){
+    vector<short> weights;
+    quantizeKernel( weights );
+    FixedPlanes planes;
+    planes.resize( width, height, kernelRADIUS );
+    toPlanes( src, planes );
+    fillBorder( planes );
+
+    // rows i and i + 1 share one packed weight per column, and an odd last
+    // row is paired with itself under a zero weight
+    vector<int> pairs( ( kernelSIZE + 1 ) / 2 * kernelSIZE );
+    for( int i=0; i<kernelSIZE; i+=2 )
+        for( int j=0; j<kernelSIZE; j++ )
+            pairs[i / 2 * kernelSIZE + j] = pairWeights( weights[i * kernelSIZE + j], i + 1 < kernelSIZE ? weights[( i + 1 ) * kernelSIZE + j] : 0 );
+
+    AxpyFixedRow axpy = axpyFixedRow();
+    forEachTile( width, height, [&]( int x0, int y0, int x1, int y1 ){
+        int acc[3][TILE_SIZE];
+        int n = x1 - x0;
+        for( int y=y0; y<y1; y++ ){
+            for( int c=0; c<3; c++ ){
+                // start from half a unit, so the shift rounds to nearest
+                fill( acc[c], acc[c] + n, 1 << ( FIXED_SHIFT - 1 ) );
+                for( int i=0; i<kernelSIZE; i+=2 ){
+                    const short* first = planes.row( c, y + i - kernelRADIUS ) + x0 - kernelRADIUS;
+                    const short* second = i + 1 < kernelSIZE ? planes.row( c, y + i + 1 - kernelRADIUS ) + x0 - kernelRADIUS : first;
+                    for( int j=0; j<kernelSIZE; j++ ){
+                        int pair = pairs[i / 2 * kernelSIZE + j];
+                        if( pair != 0 ) axpy( acc[c], first + j, second + j, pair, n );
+                    }
+                }
+            }
+            for( int k=0; k<n; k++ ){
+                Pixel& pixel = dst[y][x0 + k];
+                pixel.r = min( 255, max( 0, acc[0][k] >> FIXED_SHIFT ) );
+                pixel.g = min( 255, max( 0, acc[1][k] >> FIXED_SHIFT ) );
+                pixel.b = min( 255, max( 0, acc[2][k] >> FIXED_SHIFT ) );
+                pixel.a = src[y][x0 + k].a;
+            }
+        }
+    });
+}
+
+void boxLine( const unsigned int* in, unsigned int* out, int n, int radius, int step ){
+    // the sums are unsigned, so any wrap around in between cancels out
+    unsigned int sum = 0;
+    for( int i=0; i<radius && i<n; i++ ) sum += in[i * step];
+    for( int i=0; i<n; i++ ){
+        if( i + radius < n ) sum += in[( i + radius ) * step];
+        out[i * step] = sum;
+        if( i - radius >= 0 ) sum -= in[( i - radius ) * step];
+    }
+}
+
+void boxColumns( const unsigned int* in, unsigned int* out, int rows, int stride, int n, int radius ){
+    unsigned int sum[TILE_SIZE] = { 0 };
+    for( int y=0; y<radius && y<rows; y++ )
+        for( int x=0; x<n; x++ ) sum[x] += in[y * stride + x];
+    for( int y=0; y<rows; y++ ){
+        if( y + radius < rows )
+            for( int x=0; x<n; x++ ) sum[x] += in[( y + radius ) * stride + x];
+        for( int x=0; x<n; x++ ) out[y * stride + x] = sum[x];
+        if( y - radius >= 0 )
+            for( int x=0; x<n; x++ ) sum[x] -= in[( y - radius ) * stride + x];
+    }
+}
+
+void convolveBox( Pixel** src, Pixel** dst, int width, int height ){
+    // the final sums read kernelRADIUS past the image, so the rows and
+    // columns carry that much padding, filled following kernelBORDER
+    int pad = kernelRADIUS;
+    int rows = height + 2 * pad;
+    int plane = width * rows;
+    Buffer<unsigned int> sums( ( size_t )3 * plane );
+    sums.zero();
+
+    long long count = 1;
+    float total = 0.0f;
+    for( auto &box : kernelBOXES ) count *= box;
+    for( auto &weight : KERNEL ) total += weight;
+    float scale = total / ( float( count ) * count );
+
+    // the pixel each padded column and row reads under kernelBORDER, -1 for zero
+    vector<int> columns( width + 2 * pad );
+    for( int x=0; x<width+2*pad; x++ ) columns[x] = borderIndex( x - pad, width );
+
+    int bands = ( rows + TILE_SIZE - 1 ) / TILE_SIZE;
+    parallelFor( bands, [&]( int band ){
+        vector<unsigned int> line( width + 2 * pad ), next( width + 2 * pad );
+        for( int y=band*TILE_SIZE; y<min( rows, ( band + 1 ) * TILE_SIZE ); y++ ){
+            int source = borderIndex( y - pad, height );
+            if( source < 0 ) continue;
+            for( int c=0; c<3; c++ ){
+                for( int x=0; x<width+2*pad; x++ )
+                    line[x] = columns[x] < 0 ? 0 : ( &src[source][columns[x]].r )[c];
+                for( auto &box : kernelBOXES ){
+                    boxLine( &line[0], &next[0], width + 2 * pad, box / 2, 1 );
+                    line.swap( next );
+                }
+                copy( line.begin() + pad, line.begin() + pad + width, &sums[c * plane + y * width] );
+            }
+        }
+    });
+
+    // each strip of TILE_SIZE columns goes down through all the boxes in
+    // its own buffers before being stored
+    int strips = ( width + TILE_SIZE - 1 ) / TILE_SIZE;
+    parallelFor( 3 * strips, [&]( int item ){
+        int c = item / strips;
+        int x0 = ( item % strips ) * TILE_SIZE;
+        int n = min( TILE_SIZE, width - x0 );
+        vector<unsigned int> strip( TILE_SIZE * rows ), next( TILE_SIZE * rows );
+        for( int y=0; y<rows; y++ )
+            copy( &sums[c * plane + y * width + x0], &sums[c * plane + y * width + x0] + n, &strip[y * TILE_SIZE] );
+        for( auto &box : kernelBOXES ){
+            boxColumns( &strip[0], &next[0], rows, TILE_SIZE, n, box / 2 );
+            strip.swap( next );
+        }
+
+        for( int y=0; y<height; y++ )
+            for( int x=0; x<n; x++ ){
+                ( &dst[y][x0 + x].r )[c] = clampChannel( strip[( y + pad ) * TILE_SIZE + x] * scale );
+                if( c == 0 ) dst[y][x0 + x].a = src[y][x0 + x].a;
+            }
+    });
+}
+
+void convolveFFT( Pixel** src, Pixel** dst, int width, int height, int block ){
+    FFTPlan plan;
+    plan.build( block );
+
+    // the kernel is correlated with each block, so its spectrum is conjugated
+    vector<Complex> spectrum( block * block );
+    for( int i=0; i<kernelSIZE; i++ )
+        for( int j=0; j<kernelSIZE; j++ )
+            spectrum[i * block + j] = KERNEL[i * kernelSIZE + j];
+    fft2d( plan, &spectrum[0], false );
+    float scale = 1.0f / ( block * block );
+    for( auto &value : spectrum ) value = conj( value ) * scale;
+
+    int tile = block - 2 * kernelRADIUS;
+    forEachTile( width, height, [&]( int x0, int y0, int x1, int y1 ){
+        vector<Complex> redgreen( block * block ), blue( block * block );
+        // block row u holds image row y0 - kernelRADIUS + u, zero outside the image
+        for( int u=0; u<tile+2*kernelRADIUS; u++ ){
+            int y = borderIndex( y0 - kernelRADIUS + u, height );
+            if( y < 0 ) continue;
+            for( int v=0; v<tile+2*kernelRADIUS; v++ ){
+                int x = borderIndex( x0 - kernelRADIUS + v, width );
+                if( x < 0 ) continue;
+                redgreen[u * block + v] = Complex( src[y][x].r, src[y][x].g );
+                blue[u * block + v] = Complex( src[y][x].b, 0.0f );
+            }
+        }
+
+        fft2d( plan, &redgreen[0], false );
+        fft2d( plan, &blue[0], false );
+        for( int k=0; k<block*block; k++ ){
+            redgreen[k] = multiply( redgreen[k], spectrum[k] );
+            blue[k] = multiply( blue[k], spectrum[k] );
+        }
+        fft2d( plan, &redgreen[0], true );
+        fft2d( plan, &blue[0], true );
+
+        for( int y=y0; y<y1; y++ )
+            for( int x=x0; x<x1; x++ ){
+                int k = ( y - y0 ) * block + x - x0;
+                dst[y][x].r = clampChannel( redgreen[k].real() );
+                dst[y][x].g = clampChannel( redgreen[k].imag() );
+                dst[y][x].b = clampChannel( blue[k].real() );
+                dst[y][x].a = src[y][x].a;
+            }
+    }, tile );
+}
+
+float simdLanes(){
+    switch( simdLevel() ){
+        case SIMD_AVX2: return 8.0f;
+        case SIMD_SSE: return 4.0f;
+        default: return 1.0f;
+    }
+}
+
+float directCost(){
+    // a folded tap is one multiply, and each pre-added row pair one add
+    int rows;
+    int taps = foldedTaps( rows ).size();
+    if( kernelVSYMMETRY != 0 ) taps += kernelRADIUS;
+    return 3.0f * taps / simdLanes();
+}
+
+float separableCost(){
+    return 3.0f * ( foldedLength( kernelHSYMMETRY ) + foldedLength( kernelVSYMMETRY ) ) / simdLanes();
+}
+
+float boxCost(){
+    // an add and a subtract per box and channel, along the rows one value
+    // at a time and down the columns a vector at a time
+    return 3.0f * kernelBOXES.size() * ( 2.0f + 2.0f / simdLanes() );
+}
+
+float fftCost( int width, int height, int& block ){
+    // a radix-2 butterfly is about five multiply-adds, and each block takes
+    // two forward and two inverse 2d transforms plus the spectrum products
+    const float butterfly = 5.0f;
+    float best = -1.0f;
+    block = 0;
+    int smallest = nextPowerOfTwo( 4 * kernelRADIUS + 1 );
+    for( int size=smallest; size<=max( smallest, 1024 ); size*=2 ){
+        int tile = size - 2 * kernelRADIUS;
+        float blocks = float(( width + tile - 1 ) / tile ) * (( height + tile - 1 ) / tile );
+        float levels = log2( float( size ) );
+        float work = blocks * ( 4 * butterfly * size * size * levels + 2 * 4.0f * size * size );
+        float cost = work / ( float( width ) * height );
+        if( best < 0 || cost < best ){
+            best = cost;
+            block = size;
+        }
+    }
+    return best;
+}
+
+ConvolveMethod chooseMethod( int width, int height ){
+    if( METHOD == METHOD_SEPARABLE && !kernelSEPARABLE ) return METHOD_DIRECT;
+    if( METHOD == METHOD_BOX && kernelBOXES.empty() ) return METHOD_DIRECT;
+    if( METHOD != METHOD_AUTO ) return METHOD;
+
+    int block;
+    float direct = directCost();
+    float separable = kernelSEPARABLE ? separableCost() : direct;
+    float transform = fftCost( width, height, block );
+    if( !kernelBOXES.empty() && boxCost() < min( transform, min( direct, separable ) ) ) return METHOD_BOX;
+    if( transform < min( direct, separable ) ) return METHOD_FFT;
+    return separable < direct ? METHOD_SEPARABLE : METHOD_DIRECT;
+}
+
+string methodName( ConvolveMethod method ){
+    switch( method ){
+        case METHOD_NAIVE: return "naive";
+        case METHOD_DIRECT: return "direct";
+        case METHOD_SEPARABLE: return "separable";
+        case METHOD_FFT: return "fft";
+        case METHOD_BOX: return "box";
+        case METHOD_FIXED: return "fixed";
+        default: return "auto";
+    }
+}
+
+long long kernelMACs( ConvolveMethod method, int width, int height ){
+    double pixels = double( width ) * height;
+    int block;
+    switch( method ){
+        case METHOD_NAIVE: return 3 * kernelSIZE * kernelSIZE * pixels;
+        case METHOD_SEPARABLE: return separableCost() * simdLanes() * pixels;
+        case METHOD_FFT: return fftCost( width, height, block ) * pixels;
+        case METHOD_BOX: return boxCost() * simdLanes() * pixels;
+        default: return directCost() * simdLanes() * pixels;
+    }
+}
+
+void applyKernel( Pixel** src, Pixel** dst, int width, int height ){
+    PROFILE_SCOPE( "convolve" );
+    ConvolveMethod method = chooseMethod( width, height );
+    PROFILE_COUNT( COUNT_PIXELS, (long long)width * height );
+    PROFILE_COUNT( COUNT_MACS, kernelMACs( method, width, height ) );
+
+    int block;
+    switch( method ){
+        case METHOD_NAIVE:
+            convolveImage( src, dst, width, height );
+            break;
+        case METHOD_SEPARABLE:
+            convolvePlanarSeparable( src, dst, width, height );
+            break;
+        case METHOD_FFT:
+            fftCost( width, height, block );
+            convolveFFT( src, dst, width, height, block );
+            break;
+        case METHOD_BOX:
+            convolveBox( src, dst, width, height );
+            break;
+        case METHOD_FIXED:
+            convolveFixed( src, dst, width, height );
+            break;
+        default:
+            convolvePlanar( src, dst, width, height );
+    }
+}
@@ -6,10 +6,14 @@
 #include <algorithm>
 #include <vector>
 #include <string>
+#include <cstring>
+#include <unordered_set>
 
 #ifdef __APPLE__
 #include <GLUT/glut.h>
 #else
+// declares the pixel buffer calls of OpenGL 2.1, which display.h uses
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glut.h>
 #endif
 
@@ -21,30 +25,54 @@ struct Pixel{
     unsigned char r, g, b, a;
 };
 
+// IN is what is displayed: either ORIGINAL itself, until something changes
+// it, or one of the two work buffers, WORK and SCRATCH. Those three are
+// Images, declared in buffers.h, and free their own pixels
 Pixel** IN = NULL;
-Pixel** ORIGINAL = NULL;
 int pixel_format;
-vector<Pixel> palette1, palette2, palette3, palette4, palette5, palette6, palette7, palette8, palette9;
 int paletteHEIGHT, paletteWIDTH, paletteCHANNELS;
+// the grid of regions the palettes are mapped onto, set by --palette-grid
+int paletteCOLUMNS = 3, paletteROWS = 3;
 
 int CHANNELS;
 int imWIDTH, imHEIGHT;
 int winWIDTH, winHEIGHT;
 int vpWIDTH, vpHEIGHT;
 int Xoffset, Yoffset;
+// where the left button went down, in window coordinates
+int pressX, pressY;
 string output_filename = "";
 string input_filename;
 
 /*
-    Reads an image from input_file.
+    Reads an image from input_file, exiting if it cannot.
 */
 void readImage( string input_file );
 
+/*
+    Reads an image from input_file as readImage does. Returns false, with
+    the problem in error, if the file cannot be opened or decoded.
+*/
+bool loadImage( string input_file, string& error );
+
 /* 
     Writes stored image into output_file
 */
 void writeImage( string output_file );
 
+/*
+    Writes a pixmap straight into output_file, without going through the
+    OpenGL framebuffer, exiting if it cannot. The pixmap is stored bottom
+    scanline first.
+*/
+void writePixmap( string output_file, Pixel** pixmap, int width, int height );
+
+/*
+    Writes a pixmap as writePixmap does. Returns false, with the problem in
+    error, if the file cannot be written.
+*/
+bool savePixmap( string output_file, Pixel** pixmap, int width, int height, string& error );
+
 /*
     Routine to cleanup the memory.
 */
@@ -52,7 +80,8 @@ void destroy();
 
 /*
 	Handles Mouse click on the image.
-    Left Click stops twirling.
+    Left click maps the palettes onto the image, dragging with the left
+    button maps them onto the selected rectangle only.
 */
 void handleMouseClick( int button, int state, int x, int y );
 
@@ -80,24 +109,88 @@ void handleReshape( int w, int h );
         f,F: Reads new image from file
         w,W: Writes saved image to file
         r,R: Replays current image
+        c,C: Convolves current image with the filter
         Default: do nothing
 */
 void handleKey( unsigned char key, int x, int y );
+
+/*
+    Allocates a width x height pixmap whose rows are contiguous, and frees it.
+    The row table and the 64 byte aligned pixels share one block of BUFFERS.
+*/
+Pixel** newPixmap( int width, int height );
+void deletePixmap( Pixel**& pixmap );
+
+/*
+    Makes sure WORK and SCRATCH match the size of the image. They are kept
+    from one image to the next while the size stays the same.
+*/
+void ensureWorkBuffers();
+
+/*
+    Copy on write: before IN is changed in place, gives it a private copy
+    if it is still sharing ORIGINAL, or one of the images incremental.h
+    keeps.
+*/
+void makeWritable();
 // returns true if color is not in palette. false otherwise
 
 void createNewImage();
-void mapPalette();
-void readColorPalette( string palette_file, vector<Pixel> palette );
+/*
+    Maps the palettes onto the part of image inside [x0, x1) x [y0, y1).
+*/
+void mapPalette( Pixel** image, int x0, int y0, int x1, int y1 );
+/*
+    Reads the distinct colours of palette_file into palette. Returns false,
+    with the problem printed, if the file cannot be read.
+*/
+bool readColorPalette( string palette_file, vector<Pixel>& palette );
 void convertToOriginalImage();
 
+#include "profile.h"
+#include "threads.h"
+#include "buffers.h"
+#include "simd.h"
+#include "fft.h"
+#include "filter.h"
+#include "kernelcache.h"
+#include "pipeline.h"
+#include "rawio.h"
+#include "display.h"
+#include "incremental.h"
+#include "preview.h"
+#include "stream.h"
+#include "palette.h"
+#include "server.h"
+
 
 void readImage( string input_filename ){
+    string error;
+    if( !loadImage( input_filename, error ) ){
+        cerr << error << ". Exiting... " << endl;
+        exit( 1 );
+    }
+}
+
+bool loadImage( string input_filename, string& error ){
+    PROFILE_SCOPE( "readImage" );
+    if( isMappedFormat( input_filename ) ){
+        // readMapped leaves error empty for the files it hands on to oiio
+        error.clear();
+        if( readMapped( input_filename, error ) ){
+            buildPyramid();
+            resetSource();
+            return true;
+        }
+        if( !error.empty() ) return false;
+    }
+
     // Create the oiio file handler for the image, and open the file for reading the image.
     // Once open, the file spec will indicate the width, height and number of channels.
     auto infile = ImageInput::open( input_filename );
     if ( !infile ){
-        cerr << "Failed to open input file: " << input_filename << ". Exiting... " << endl;
-        exit( 1 );
+        error = "Failed to open input file: " + input_filename;
+        return false;
     }
     // Record image width, height and number of channels in global variables
     imWIDTH = infile->spec().width;
@@ -106,69 +199,47 @@ void readImage( string input_filename ){
 	winWIDTH = imWIDTH;
 	winHEIGHT = imHEIGHT;
 
-    // allocate temporary structure to read the image
-    unsigned char temp_pixels[ imWIDTH * imHEIGHT * CHANNELS ];
-    // read the image into the tmp_pixels from the input file, flipping it upside down using negative y-stride,
+    // decode straight into the pixmap, one Pixel apart, flipping it upside down using negative y-stride,
     // since OpenGL pixmaps have the bottom scanline first, and
     // oiio expects the top scanline first in the image file.
-    int scanline_size = imWIDTH * CHANNELS * sizeof( unsigned char );
-    if( !infile->read_image( TypeDesc::UINT8, &temp_pixels[0] + (imHEIGHT - 1) * scanline_size, AutoStride, -scanline_size)){
-        cerr << "Failed to read file " << input_filename << ". Exiting... " << endl;
-        exit( 0 );
+    // Channels the file does not have keep the 255 the pixmap is filled with.
+    int channels = min( CHANNELS, 4 );
+    ORIGINAL.resize( imWIDTH, imHEIGHT );
+    Pixel** image = ORIGINAL.pixels;
+    if( channels < 4 ){
+        PROFILE_SCOPE( "alpha" );
+        memset( image[0], 255, imWIDTH * imHEIGHT * sizeof( Pixel ) );
+    }
+    int scanline_size = imWIDTH * sizeof( Pixel );
+    if( !infile->read_image( 0, 0, 0, channels, TypeDesc::UINT8, (unsigned char*)image[0] + (imHEIGHT - 1) * scanline_size, sizeof( Pixel ), -scanline_size )){
+        error = "Failed to read input file: " + input_filename;
+        ORIGINAL.reset();
+        return false;
     }
 
-    // allocates the space necessary for data struct
-    IN = new Pixel*[imHEIGHT];
-	IN[0] = new Pixel[imHEIGHT*imWIDTH];
-	for( int i=1; i<imHEIGHT; i++ ) IN[i] = IN[i-1] + imWIDTH;
-
-    ORIGINAL = new Pixel*[imHEIGHT];
-    ORIGINAL[0] = new Pixel[imHEIGHT*imWIDTH];
-    for( int i=1; i<imHEIGHT; i++ ) ORIGINAL[i] = ORIGINAL[i-1] + imWIDTH;
-
-    // reads in image pixel into data structure
-    int idx;
-    for( int y=0; y<imHEIGHT; ++y ){
-        for( int x=0; x<imWIDTH; ++x ){
-            idx = ( y * imWIDTH + x ) * CHANNELS;
-            if( CHANNELS == 1 ){
-                IN[y][x].r = temp_pixels[idx];
-                IN[y][x].g = temp_pixels[idx];
-                IN[y][x].b = temp_pixels[idx];
-                IN[y][x].a = 255;
-                ORIGINAL[y][x].r = temp_pixels[idx];
-                ORIGINAL[y][x].g = temp_pixels[idx];
-                ORIGINAL[y][x].b = temp_pixels[idx];
-                ORIGINAL[y][x].a = 255;
-            } else {
-                IN[y][x].r = temp_pixels[idx];
-                IN[y][x].g = temp_pixels[idx + 1];
-                IN[y][x].b = temp_pixels[idx + 2];
-                ORIGINAL[y][x].r = temp_pixels[idx];
-                ORIGINAL[y][x].g = temp_pixels[idx + 1];
-                ORIGINAL[y][x].b = temp_pixels[idx + 2];
-				// no alpha value present
-                if( CHANNELS < 4 ){
-                    IN[y][x].a = 255;
-                    ORIGINAL[y][x].a = 255;
-                }
-				// alpha value present
-                else{ 
-                    IN[y][x].a = temp_pixels[idx + 3];
-                    ORIGINAL[y][x].a = temp_pixels[idx + 3];
-                }
-            }
+    // grey images land in r (and alpha in g), spread them over rgb
+    if( channels < 3 ){
+        PROFILE_SCOPE( "alpha" );
+        for( int i=0; i<imWIDTH*imHEIGHT; i++ ){
+            Pixel& pixel = image[0][i];
+            pixel.a = channels == 2 ? pixel.g : 255;
+            pixel.g = pixel.b = pixel.r;
         }
     }
+    IN = ORIGINAL.pixels;
+    PROFILE_COUNT( COUNT_BYTES_READ, (long long)imWIDTH * imHEIGHT * CHANNELS );
 
     // close the image file after reading, and free up space for the oiio file handler
-    infile->close();
     pixel_format = GL_RGBA;
     CHANNELS = 4;
     infile->close();
+    buildPyramid();
+    resetSource();
+    return true;
 }
 
 void writeImage( string filename ){
+    PROFILE_SCOPE( "writeImage" );
     // make a pixmap that is the size of the window and grab OpenGL framebuffer into it
     // alternatively, you can read the pixmap into a 1d array and export this
     unsigned char temp_pixmap[ winWIDTH * winHEIGHT * CHANNELS ];
@@ -198,23 +269,94 @@ void writeImage( string filename ){
         cerr << "Failed to write to output file: " << filename << ". Exiting... " << endl;
         exit( 1 );
     }
+    PROFILE_COUNT( COUNT_BYTES_WRITTEN, (long long)winHEIGHT * scanline_size );
 
     // close the image file after the image is written and free up space for the
     // ooio file handler
     outfile->close();
 }
 
+void writePixmap( string filename, Pixel** pixmap, int width, int height ){
+    string error;
+    if( !savePixmap( filename, pixmap, width, height, error ) ){
+        cerr << error << ". Exiting... " << endl;
+        exit( 1 );
+    }
+}
+
+bool savePixmap( string filename, Pixel** pixmap, int width, int height, string& error ){
+    PROFILE_SCOPE( "writeImage" );
+    if( isMappedFormat( filename ) ) return writeMapped( filename, pixmap, width, height, error );
+
+    auto outfile = ImageOutput::create( filename );
+    if( !outfile ){
+        error = "Failed to create output file: " + filename;
+        return false;
+    }
+
+    ImageSpec spec( width, height, 4, TypeDesc::UINT8 );
+    if (!outfile->open( filename, spec )){
+        error = "Failed to open output file: " + filename;
+        return false;
+    }
+
+    // the rows of the pixmap are contiguous, so it can be written directly,
+    // flipping it upside down with a negative y stride
+    int scanline_size = width * sizeof( Pixel );
+    if( !outfile->write_image( TypeDesc::UINT8, (unsigned char*)pixmap[0] + (height - 1) * scanline_size, AutoStride, -scanline_size )){
+        error = "Failed to write to output file: " + filename;
+        return false;
+    }
+    PROFILE_COUNT( COUNT_BYTES_WRITTEN, (long long)height * scanline_size );
+
+    outfile->close();
+    return true;
+}
+
+Pixel** newPixmap( int width, int height ){
+    // the row table first, the pixels after it on the next aligned byte
+    size_t table = ( height * sizeof( Pixel* ) + BUFFER_ALIGN - 1 ) / BUFFER_ALIGN * BUFFER_ALIGN;
+    char* block = ( char* )BUFFERS.acquire( table + ( size_t )width * height * sizeof( Pixel ) );
+    Pixel** pixmap = ( Pixel** )block;
+    pixmap[0] = ( Pixel* )( block + table );
+    for( int i=1; i<height; i++ ) pixmap[i] = pixmap[i-1] + width;
+    return pixmap;
+}
+
+void deletePixmap( Pixel**& pixmap ){
+    if( pixmap ){
+        // pixmaps over mapped files give back their pages instead
+        if( unmapPixmap( pixmap ) ) delete[] pixmap;
+        else BUFFERS.release( pixmap );
+        pixmap = NULL;
+    }
+}
+
+void ensureWorkBuffers(){
+    WORK.resize( imWIDTH, imHEIGHT );
+    SCRATCH.resize( imWIDTH, imHEIGHT );
+}
+
+void makeWritable(){
+    if( !IN || IN == WORK.pixels || IN == SCRATCH.pixels ) return;
+    ensureWorkBuffers();
+    memcpy( WORK.pixels[0], IN[0], imWIDTH * imHEIGHT * sizeof( Pixel ) );
+    IN = WORK.pixels;
+}
+
 void convertToOriginalImage(){
-    for( int i=0; i<imHEIGHT; i++)
-        for( int j=0; j<imWIDTH; j++)
-            IN[i][j] = ORIGINAL[i][j];
+    stopRefinement( true );
+    // the original is never written, so resetting is only a pointer swap
+    IN = ORIGINAL.pixels;
+    revertSource();
 }
 
 void destroy(){
-    if ( IN ){
-        delete IN[0];
-        delete IN;
-    }
+    stopRefinement( true );
+    // the work buffers stay around for the next image
+    ORIGINAL.reset();
+    IN = SOURCE = NULL;
+    convolvedVALID = false;
 }
 
 void handleKey( unsigned char key, int x, int y ){
@@ -236,6 +378,11 @@ void handleKey( unsigned char key, int x, int y ){
                 cout << "Enter an output filename: ";
                 cin >> output_filename;
             }
+            if( refining() ){
+                // the window has to show the full resolution result first
+                stopRefinement( false );
+                handleDisplay();
+            }
             writeImage( output_filename );
             break;
         case 'r': case 'R':
@@ -243,6 +390,10 @@ void handleKey( unsigned char key, int x, int y ){
             convertToOriginalImage();
             glutPostRedisplay();
             break;
+        case 'c': case 'C':
+            progressiveConvolve();
+            glutPostRedisplay();
+            break;
         default:
             return;
     }
@@ -251,10 +402,26 @@ void handleKey( unsigned char key, int x, int y ){
 void handleMouseClick(int button, int state, int x, int y){
 	switch( button ){
 		case GLUT_LEFT_BUTTON:
+			if( state == GLUT_DOWN ){
+                pressX = x;
+                pressY = y;
+                break;
+            }
 			if( state == GLUT_UP ){
 				// left mouse click
-                // stops twirl
-                createNewImage();
+                // maps the palettes onto the image, or onto the selection
+                // if the mouse was dragged
+                stopRefinement( false );
+                if( abs( x - pressX ) <= 2 && abs( y - pressY ) <= 2 ) createNewImage();
+                else{
+                    // window rows go down, image rows go up
+                    int x0 = ( min( x, pressX ) - Xoffset ) * imWIDTH / vpWIDTH;
+                    int x1 = ( max( x, pressX ) + 1 - Xoffset ) * imWIDTH / vpWIDTH;
+                    int y0 = ( winHEIGHT - 1 - max( y, pressY ) - Yoffset ) * imHEIGHT / vpHEIGHT;
+                    int y1 = ( winHEIGHT - min( y, pressY ) - Yoffset ) * imHEIGHT / vpHEIGHT;
+                    Rect selection = { x0, y0, x1, y1 };
+                    mapSelection( selection );
+                }
                 glutPostRedisplay();
 				break;
 			}
@@ -265,6 +432,8 @@ void handleMouseClick(int button, int state, int x, int y){
 }
 
 void handleDisplay(){
+    PROFILE_SCOPE( "frame" );
+    auto start = chrono::steady_clock::now();
     // specify window clear (background) color to be opaque black
     glClearColor( 0, 0, 0, 1 );
     // clear window to background color
@@ -275,20 +444,21 @@ void handleDisplay(){
 
     // flush the OpenGL pipeline to the viewport
     glFlush();
+    countFrame( start );
 }
 
 void displayImage(){
-    // if the window is smaller than the image, scale it down, otherwise do not scale
-    if(winWIDTH < imWIDTH  || winHEIGHT < imHEIGHT)
-        glPixelZoom(float(vpWIDTH) / imWIDTH, float(vpHEIGHT) / imHEIGHT);
-    else
-        glPixelZoom(1.0, 1.0);
-
-        // display starting at the lower lefthand corner of the viewport
-        glRasterPos2i(0, 0);
+    if( refining() ){
+        // the preview is smaller than the image, and always scaled to the viewport
+        glPixelZoom( float( vpWIDTH ) / PREVIEW.width, float( vpHEIGHT ) / PREVIEW.height );
+        glRasterPos2i( 0, 0 );
+        glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+        glDrawPixels( PREVIEW.width, PREVIEW.height, pixel_format, GL_UNSIGNED_BYTE, PREVIEW.pixels[0] );
+        return;
+    }
 
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-        glDrawPixels(imWIDTH, imHEIGHT, pixel_format, GL_UNSIGNED_BYTE, IN[0]);
+    // only what changed since the last frame is sent to the driver
+    drawImage();
 }
 
 void handleReshape(int w, int h){
@@ -333,11 +503,13 @@ void handleReshape(int w, int h){
     glMatrixMode( GL_MODELVIEW );
 }
 
-void readColorPalette( string palette_file, vector<Pixel> palette ){
+bool readColorPalette( string palette_file, vector<Pixel>& palette ){
+    palette.clear();
     auto infile = ImageInput::open( palette_file );
     if ( !infile ){
-        cerr << "Failed to open input file: " << input_filename << ". Exiting... " << endl;
-        exit( 1 );
+        // a missing palette only leaves its regions alone
+        cerr << "Failed to open palette file: " << palette_file << endl;
+        return false;
     }
     // Record image width, height and number of channels in global variables
     paletteWIDTH = infile->spec().width;
@@ -345,243 +517,46 @@ void readColorPalette( string palette_file, vector<Pixel> palette ){
     paletteCHANNELS = infile->spec().nchannels;
 
     // allocate temporary structure to read the image
-    unsigned char temp_pixels[ paletteWIDTH * paletteHEIGHT * paletteCHANNELS ];
+    vector<unsigned char> temp_pixels( paletteWIDTH * paletteHEIGHT * paletteCHANNELS );
     // read the image into the tmp_pixels from the input file, flipping it upside down using negative y-stride,
     // since OpenGL pixmaps have the bottom scanline first, and
     // oiio expects the top scanline first in the image file.
     int scanline_size = paletteWIDTH * paletteCHANNELS * sizeof( unsigned char );
     if( !infile->read_image( TypeDesc::UINT8, &temp_pixels[0] + (paletteHEIGHT - 1) * scanline_size, AutoStride, -scanline_size)){
-        cerr << "Failed to read file " << input_filename << ". Exiting... " << endl;
-        exit( 0 );
+        cerr << "Failed to read palette file: " << palette_file << endl;
+        return false;
     }
 
-    // allocates the space necessary for data struct
-    // 16 colors on palette
+    // adds each color to the palette only if not in palette already
+    unordered_set<unsigned int> seen;
     int idx = 0;
     Pixel color;
     for( int y=0; y<paletteHEIGHT*paletteWIDTH; y++){
-        color.r = temp_pixels[idx++];
-        color.g = temp_pixels[idx++];
-        color.b = temp_pixels[idx++];
-        if( paletteCHANNELS < 4 ) color.a = 255;
-        else color.a = temp_pixels[idx++];
-        // adds to color palette only if not in palette already
-        if( palette.size()==0 ){
-            palette.push_back( color );
-            return;
-        }
-        for( int i=0; i<palette.size(); i++){
-            if( palette[i].r == color.r && palette[i].g == color.g && palette[i].b == color.b) return;
-            if( i==palette.size()-1 ) palette.push_back( color );
-        }
+        color.r = temp_pixels[idx];
+        color.g = paletteCHANNELS < 3 ? color.r : temp_pixels[idx + 1];
+        color.b = paletteCHANNELS < 3 ? color.r : temp_pixels[idx + 2];
+        color.a = paletteCHANNELS < 4 ? 255 : temp_pixels[idx + 3];
+        idx += paletteCHANNELS;
+        if( seen.insert( ( color.r << 16 ) | ( color.g << 8 ) | color.b ).second ) palette.push_back( color );
     }
     infile->close();
+    return true;
 }
 
-// calculatd using distance formula
-void mapPalette(){
-    Pixel best_pixel;
-    int least_distance, current_distance;
-    int palette_num = 1;
-    int x_offset = 0;
-    int y_offset = 0;
-    int x_bounds = imWIDTH/3;
-    int y_bounds = imHEIGHT/3;
-    Pixel current_color;
-    while (palette_num < 10){
-        switch (palette_num){
-            case 1:
-                for( int y=y_offset; y<x_bounds+y_offset; y++ )
-                    for( int x=x_offset; x<y_bounds+x_offset; x++ ){
-                        least_distance = 256;
-                        current_color = { IN[y][x].r, IN[y][x].g, IN[y][x].b, IN[y][x].a };
-                        for( auto &iter : palette1 ){
-                            // gets smallest distance between color in palette vs color in image for mapping
-                            current_distance = sqrt( pow((float)current_color.r - (float)iter.r,2) + pow((float)current_color.g - (float)iter.g,2) + pow((float)current_color.b - (float)iter.b,2) + pow((float)current_color.a - (float)iter.a,2) );
-                            if( current_distance < least_distance ){
-                                // sets best color
-                                best_pixel = iter;
-                                least_distance = current_distance;
-                            }
-                        }
-                        IN[y][x] = best_pixel;
-                    }
-                x_offset += x_bounds;
-                y_offset += y_bounds;
-                palette_num++;
-                break;
-            case 2:
-                for( int y=y_offset; y<x_bounds+y_offset; y++ )
-                    for( int x=x_offset; x<y_bounds+x_offset; x++ ){
-                        least_distance = 256;
-                        current_color = { IN[y][x].r, IN[y][x].g, IN[y][x].b, IN[y][x].a };
-                        for( auto &iter : palette2 ){
-                            // gets smallest distance between color in palette vs color in image for mapping
-                            current_distance = sqrt( pow((float)current_color.r - (float)iter.r,2) + pow((float)current_color.g - (float)iter.g,2) + pow((float)current_color.b - (float)iter.b,2) + pow((float)current_color.a - (float)iter.a,2) );
-                            if( current_distance < least_distance ){
-                                // sets best color
-                                best_pixel = iter;
-                                least_distance = current_distance;
-                            }
-                        }
-                        IN[y][x] = best_pixel;
-                    }
-                x_offset += x_bounds;
-                y_offset += y_bounds;
-                palette_num++;
-                break;
-            case 3:
-                for( int y=y_offset; y<x_bounds+y_offset; y++ )
-                    for( int x=x_offset; x<y_bounds+x_offset; x++ ){
-                        least_distance = 256;
-                        current_color = { IN[y][x].r, IN[y][x].g, IN[y][x].b, IN[y][x].a };
-                        for( auto &iter : palette3 ){
-                            // gets smallest distance between color in palette vs color in image for mapping
-                            current_distance = sqrt( pow((float)current_color.r - (float)iter.r,2) + pow((float)current_color.g - (float)iter.g,2) + pow((float)current_color.b - (float)iter.b,2) + pow((float)current_color.a - (float)iter.a,2) );
-                            if( current_distance < least_distance ){
-                                // sets best color
-                                best_pixel = iter;
-                                least_distance = current_distance;
-                            }
-                        }
-                        IN[y][x] = best_pixel;
-                    }
-                x_offset += x_bounds;
-                y_offset += y_bounds;
-                palette_num++;
-                break;
-            case 4:
-                for( int y=y_offset; y<x_bounds+y_offset; y++ )
-                    for( int x=x_offset; x<y_bounds+x_offset; x++ ){
-                        least_distance = 256;
-                        current_color = { IN[y][x].r, IN[y][x].g, IN[y][x].b, IN[y][x].a };
-                        for( auto &iter : palette4 ){
-                            // gets smallest distance between color in palette vs color in image for mapping
-                            current_distance = sqrt( pow((float)current_color.r - (float)iter.r,2) + pow((float)current_color.g - (float)iter.g,2) + pow((float)current_color.b - (float)iter.b,2) + pow((float)current_color.a - (float)iter.a,2) );
-                            if( current_distance < least_distance ){
-                                // sets best color
-                                best_pixel = iter;
-                                least_distance = current_distance;
-                            }
-                        }
-                        IN[y][x] = best_pixel;
-                    }
-                x_offset += x_bounds;
-                y_offset += y_bounds;
-                break;
-            case 5:
-                for( int y=y_offset; y<x_bounds+y_offset; y++ )
-                    for( int x=x_offset; x<y_bounds+x_offset; x++ ){
-                        least_distance = 256;
-                        current_color = { IN[y][x].r, IN[y][x].g, IN[y][x].b, IN[y][x].a };
-                        for( auto &iter : palette5 ){
-                            // gets smallest distance between color in palette vs color in image for mapping
-                            current_distance = sqrt( pow((float)current_color.r - (float)iter.r,2) + pow((float)current_color.g - (float)iter.g,2) + pow((float)current_color.b - (float)iter.b,2) + pow((float)current_color.a - (float)iter.a,2) );
-                            if( current_distance < least_distance ){
-                                // sets best color
-                                best_pixel = iter;
-                                least_distance = current_distance;
-                            }
-                        }
-                        IN[y][x] = best_pixel;
-                    }
-                x_offset += x_bounds;
-                y_offset += y_bounds;
-                palette_num++;
-                break;
-            case 6:
-                for( int y=y_offset; y<x_bounds+y_offset; y++ )
-                    for( int x=x_offset; x<y_bounds+x_offset; x++ ){
-                        least_distance = 256;
-                        current_color = { IN[y][x].r, IN[y][x].g, IN[y][x].b, IN[y][x].a };
-                        for( auto &iter : palette6 ){
-                            // gets smallest distance between color in palette vs color in image for mapping
-                            current_distance = sqrt( pow((float)current_color.r - (float)iter.r,2) + pow((float)current_color.g - (float)iter.g,2) + pow((float)current_color.b - (float)iter.b,2) + pow((float)current_color.a - (float)iter.a,2) );
-                            if( current_distance < least_distance ){
-                                // sets best color
-                                best_pixel = iter;
-                                least_distance = current_distance;
-                            }
-                        }
-                        IN[y][x] = best_pixel;
-                    }
-                x_offset += x_bounds;
-                y_offset += y_bounds;
-                palette_num++;
-                break;
-            case 7:
-                for( int y=y_offset; y<x_bounds+offset; y++ )
-                    for( int x=x_offset; x<y_bounds+offset; x++ ){
-                        least_distance = 256;
-                        current_color = { IN[y][x].r, IN[y][x].g, IN[y][x].b, IN[y][x].a };
-                        for( auto &iter : palette7 ){
-                            // gets smallest distance between color in palette vs color in image for mapping
-                            current_distance = sqrt( pow((float)current_color.r - (float)iter.r,2) + pow((float)current_color.g - (float)iter.g,2) + pow((float)current_color.b - (float)iter.b,2) + pow((float)current_color.a - (float)iter.a,2) );
-                            if( current_distance < least_distance ){
-                                // sets best color
-                                best_pixel = iter;
-                                least_distance = current_distance;
-                            }
-                        }
-                        IN[y][x] = best_pixel;
-                    }
-                x_offset += x_bounds;
-                y_offset += y_bounds;
-                palette_num++;
-                break;
-            case 8:
-                for( int y=y_offset; y<x_bounds+y_offset; y++ )
-                    for( int x=x_offset; x<y_bounds+x_offset; x++ ){
-                        least_distance = 256;
-                        current_color = { IN[y][x].r, IN[y][x].g, IN[y][x].b, IN[y][x].a };
-                        for( auto &iter : palette8 ){
-                            // gets smallest distance between color in palette vs color in image for mapping
-                            current_distance = sqrt( pow((float)current_color.r - (float)iter.r,2) + pow((float)current_color.g - (float)iter.g,2) + pow((float)current_color.b - (float)iter.b,2) + pow((float)current_color.a - (float)iter.a,2) );
-                            if( current_distance < least_distance ){
-                                // sets best color
-                                best_pixel = iter;
-                                least_distance = current_distance;
-                            }
-                        }
-                        IN[y][x] = best_pixel;
-                    }
-                x_offset += x_bounds;
-                y_offset += y_bounds;
-                palette_num++;
-                break;
-            case 9:
-                for( int y=y_offset; y<x_bounds+y_offset; y++ )
-                    for( int x=x_offset; x<y_bounds+x_offset; x++ ){
-                        least_distance = 256;
-                        current_color = { IN[y][x].r, IN[y][x].g, IN[y][x].b, IN[y][x].a };
-                        for( auto &iter : palette9 ){
-                            // gets smallest distance between color in palette vs color in image for mapping
-                            current_distance = sqrt( pow((float)current_color.r - (float)iter.r,2) + pow((float)current_color.g - (float)iter.g,2) + pow((float)current_color.b - (float)iter.b,2) + pow((float)current_color.a - (float)iter.a,2) );
-                            if( current_distance < least_distance ){
-                                // sets best color
-                                best_pixel = iter;
-                                least_distance = current_distance;
-                            }
-                        }
-                        IN[y][x] = best_pixel;
-                    }
-                x_offset += x_bounds;
-                y_offset += y_bounds;
-                palette_num++;
-                break;
-        }
-    }
+// maps each region of the palette grid to a palette, cycling through the nine
+void mapPalette( Pixel** image, int x0, int y0, int x1, int y1 ){
+    // palettes and their nearest colour tables are only read and built again
+    // when the file changes
+    vector<const PaletteLUT*> luts;
+    for( int i=1; i<=9; i++ ) luts.push_back( &cachedPalette( "colorPalette" + to_string( i ) + ".png" ) );
+
+    vector<int> assignment( paletteCOLUMNS * paletteROWS );
+    for( int i=0; i<(int)assignment.size(); i++ ) assignment[i] = i % 9;
+    mapPaletteGrid( image, imWIDTH, imHEIGHT, luts, paletteCOLUMNS, paletteROWS, assignment, x0, y0, x1, y1 );
 }
 
 void createNewImage(){
-    readColorPalette( "colorPalette1.png", palette1 );
-    readColorPalette( "colorPalette2.png", palette2 );
-    readColorPalette( "colorPalette3.png", palette3 );
-    readColorPalette( "colorPalette4.png", palette4 );
-    readColorPalette( "colorPalette5.png", palette5 );
-    readColorPalette( "colorPalette6.png", palette6 );
-    readColorPalette( "colorPalette7.png", palette7 );
-    readColorPalette( "colorPalette8.png", palette8 );
-    readColorPalette( "colorPalette9.png", palette9 );
-    mapPalette();
-}
\ No newline at end of file
+    makeWritable();
+    mapPalette( IN, 0, 0, imWIDTH, imHEIGHT );
+    markStale( imageRect() );
+}
@@ -0,0 +1,185 @@
+/*
+    Incremental convolution of interactive edits.
+
+    The window keeps SOURCE, the image as loaded with whatever selections
+    have been mapped onto it since, and CONVOLVED, one pass of the pipeline
+    over it. A pixel of the pass only depends on the source pixels within
+    the pipeline's reach, the sum of the stage radii, so when part of SOURCE
+    changes only that part grown by the reach is convolved again, from a
+    window of SOURCE grown by twice the reach so that the window's own
+    edges stay out of it. The work scales with the size of the edit, not
+    of the image.
+
+    Mapping a selection while the window shows CONVOLVED maps it onto
+    SOURCE and updates CONVOLVED around it at once. Pressing 'c' on SOURCE,
+    after 'r' say, only convolves what changed since CONVOLVED was made.
+*/
+
+// the image the window's edits go to: ORIGINAL, or EDITED once a selection
+// has been mapped onto it, which then differs from ORIGINAL inside sourceEDITS
+Pixel** SOURCE = NULL;
+Image EDITED;
+Rect sourceEDITS = { 0, 0, 0, 0 };
+
+// one pass of the pipeline over SOURCE, out of date inside convolvedSTALE,
+// if convolvedVALID
+Image CONVOLVED;
+bool convolvedVALID = false;
+Rect convolvedSTALE = { 0, 0, 0, 0 };
+
+/*
+    The distance, in pixels, over which one pass of the pipeline spreads a
+    change of the image.
+*/
+int pipelineReach();
+
+/*
+    Starts tracking a newly read image, which is both IN and SOURCE.
+*/
+void resetSource();
+
+/*
+    Drops the edits of SOURCE and makes ORIGINAL, which IN now is, the
+    source again. CONVOLVED is kept, out of date where the edits were.
+*/
+void revertSource();
+
+/*
+    Keeps IN, which has to be one pass of the pipeline over SOURCE, as
+    CONVOLVED, and shows that copy from now on.
+*/
+void keepConvolution();
+
+/*
+    Shows CONVOLVED in place of SOURCE, bringing it up to date first.
+    Returns false, doing nothing, if the window does not show SOURCE, or if
+    CONVOLVED is missing or so far out of date that a full pass is as cheap.
+*/
+bool convolveIncrementally();
+
+/*
+    Convolves SOURCE again inside convolvedSTALE grown by the reach, into
+    CONVOLVED.
+*/
+void refreshConvolution();
+
+/*
+    Maps the palettes onto the selection of the image the window shows.
+    Selections on SOURCE, or on CONVOLVED, go to SOURCE, and CONVOLVED
+    follows them if it is shown. Any other image is mapped in place.
+*/
+void mapSelection( Rect selection );
+
+
+int pipelineReach(){
+    int reach = 0;
+    for( auto &stage : PIPELINE ) reach += stage.size / 2;
+    return reach;
+}
+
+void resetSource(){
+    SOURCE = ORIGINAL.pixels;
+    sourceEDITS = emptyRect();
+    convolvedVALID = false;
+    convolvedSTALE = emptyRect();
+    markStale( imageRect() );
+}
+
+void revertSource(){
+    if( SOURCE != ORIGINAL.pixels ){
+        convolvedSTALE = unite( convolvedSTALE, sourceEDITS );
+        SOURCE = ORIGINAL.pixels;
+        sourceEDITS = emptyRect();
+    }
+    markStale( imageRect() );
+}
+
+void keepConvolution(){
+    CONVOLVED.resize( imWIDTH, imHEIGHT );
+    if( IN != CONVOLVED.pixels ) memcpy( CONVOLVED.pixels[0], IN[0], ( size_t )imWIDTH * imHEIGHT * sizeof( Pixel ) );
+    convolvedVALID = true;
+    convolvedSTALE = emptyRect();
+    IN = CONVOLVED.pixels;
+    markStale( imageRect() );
+}
+
+bool convolveIncrementally(){
+    if( !IN || IN != SOURCE || !convolvedVALID || PIPELINE.empty() ) return false;
+    Rect window = clipToImage( grow( convolvedSTALE, 2 * pipelineReach() ) );
+    // past half the image, the full pass and its preview are the better deal
+    if( ( long long )( window.x1 - window.x0 ) * ( window.y1 - window.y0 ) * 2 > ( long long )imWIDTH * imHEIGHT ) return false;
+
+    refreshConvolution();
+    IN = CONVOLVED.pixels;
+    markStale( imageRect() );
+    return true;
+}
+
+void refreshConvolution(){
+    if( isEmpty( convolvedSTALE ) ) return;
+    PROFILE_SCOPE( "refreshConvolution" );
+    int reach = pipelineReach();
+    Rect changed = grow( convolvedSTALE, reach );
+    Rect window = grow( convolvedSTALE, 2 * reach );
+
+    // wrapped borders carry changes near one edge over to the other, so a
+    // window reaching an edge takes the whole row or column, both edges
+    // included
+    bool wraps = false;
+    for( auto &stage : PIPELINE ) wraps = wraps || stage.border == BORDER_WRAP;
+    if( wraps && ( window.x0 < 0 || window.x1 > imWIDTH ) ) changed.x0 = window.x0 = 0, changed.x1 = window.x1 = imWIDTH;
+    if( wraps && ( window.y0 < 0 || window.y1 > imHEIGHT ) ) changed.y0 = window.y0 = 0, changed.y1 = window.y1 = imHEIGHT;
+    changed = clipToImage( changed );
+    window = clipToImage( window );
+
+    int width = window.x1 - window.x0, height = window.y1 - window.y0;
+    Image source( width, height ), first( width, height ), second( width, height );
+    for( int y=0; y<height; y++ )
+        memcpy( source.pixels[y], &SOURCE[window.y0 + y][window.x0], width * sizeof( Pixel ) );
+
+    // each stage runs with the method it has on the whole image, so that
+    // the window comes out as it would have there
+    Pixel** src = source.pixels;
+    Pixel** out = first.pixels;
+    ConvolveMethod method = METHOD;
+    for( auto &stage : PIPELINE ){
+        useFilter( stage );
+        METHOD = chooseMethod( imWIDTH, imHEIGHT );
+        applyKernel( src, out, width, height );
+        src = out;
+        out = out == first.pixels ? second.pixels : first.pixels;
+    }
+    METHOD = method;
+    useFilter( PIPELINE[0] );
+
+    for( int y=changed.y0; y<changed.y1; y++ )
+        memcpy( &CONVOLVED.pixels[y][changed.x0], &src[y - window.y0][changed.x0 - window.x0], ( changed.x1 - changed.x0 ) * sizeof( Pixel ) );
+    convolvedSTALE = emptyRect();
+    if( IN == CONVOLVED.pixels ) markStale( changed );
+}
+
+void mapSelection( Rect selection ){
+    selection = clipToImage( selection );
+    if( isEmpty( selection ) || !IN ) return;
+
+    bool shown = convolvedVALID && IN == CONVOLVED.pixels;
+    if( IN != SOURCE && !shown ){
+        makeWritable();
+        mapPalette( IN, selection.x0, selection.y0, selection.x1, selection.y1 );
+        markStale( selection );
+        return;
+    }
+
+    if( SOURCE == ORIGINAL.pixels ){
+        // ORIGINAL is never written, the edits go to a copy
+        EDITED.resize( imWIDTH, imHEIGHT );
+        memcpy( EDITED.pixels[0], ORIGINAL.pixels[0], ( size_t )imWIDTH * imHEIGHT * sizeof( Pixel ) );
+        if( IN == SOURCE ) IN = EDITED.pixels;
+        SOURCE = EDITED.pixels;
+    }
+    mapPalette( SOURCE, selection.x0, selection.y0, selection.x1, selection.y1 );
+    sourceEDITS = unite( sourceEDITS, selection );
+    convolvedSTALE = unite( convolvedSTALE, selection );
+    if( shown ) refreshConvolution();
+    else markStale( selection );
+}
@@ -0,0 +1,190 @@
+/*
+    On-disk cache of compiled kernels.
+
+    Reading a .filt file, normalizing and flipping the kernel and looking for
+    separability, boxes and symmetry is done once per distinct kernel. The
+    result is stored in binary form in the cache directory, in a file named after
+    a hash of the text it was compiled from, and any later run that meets
+    the same text, from whatever file or inline kernel, maps that file
+    instead. A changed filter has another hash, so entries never go stale,
+    and the directory can be deleted at any time.
+
+    The cache is off unless a directory is given, with --kernel-cache or
+    CONVOLVE_KERNEL_CACHE.
+
+    The cache is in the native byte order and float format, it is not meant
+    to be moved between machines.
+*/
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// directory of the cache, set by --kernel-cache. Empty means
+// CONVOLVE_KERNEL_CACHE, and "off" turns the cache off even if that is set
+string KERNEL_CACHE = "";
+
+// bumped whenever the layout or the meaning of a record changes
+const char KERNEL_MAGIC[8] = "CVKERN2";
+
+enum KernelFlag{ KERNEL_SEPARABLE = 1 };
+
+/*
+    Header of a cached kernel. It is followed by the size x size weights,
+    already normalized and flipped, then for separable kernels the column
+    and row vectors, then the box widths.
+*/
+struct KernelRecord{
+    char magic[8];
+    unsigned long long hash;
+    unsigned long long length;
+    int size, header, boxes;
+    unsigned int flags;
+    // horizontal, vertical and point symmetry
+    int symmetry[3];
+};
+
+/*
+    Fills the kernel globals from the text of a .filt file, as readKernel,
+    normalizeFilter and flipKernel would one after the other, going through
+    the cache. Returns false, with the problem in error, if the text is
+    malformed.
+*/
+bool compileKernel( const string& text, string& error );
+
+/*
+    The cache directory, created if needed. Empty if no directory was given,
+    the cache is off, or the directory cannot be created.
+*/
+string kernelCacheDir();
+
+/*
+    64 bit FNV-1a hash of text.
+*/
+unsigned long long hashText( const string& text );
+
+/*
+    Maps the record at path into the kernel globals. Returns false if it is
+    missing or is not the record of a text of length characters hashing to
+    hash.
+*/
+bool loadKernelRecord( string path, unsigned long long hash, size_t length );
+
+/*
+    Writes the kernel globals as the record of a text of length characters
+    hashing to hash. The record appears at path in one go, so concurrent
+    runs never see half of it.
+*/
+void storeKernelRecord( string path, unsigned long long hash, size_t length );
+
+
+bool compileKernel( const string& text, string& error ){
+    unsigned long long hash = hashText( text );
+    string directory = kernelCacheDir();
+    string path = "";
+    if( !directory.empty() ){
+        char name[32];
+        snprintf( name, sizeof( name ), "/%016llx.kern", hash );
+        path = directory + name;
+        if( loadKernelRecord( path, hash, text.size() ) ) return true;
+    }
+
+    PROFILE_SCOPE( "compileKernel" );
+    istringstream in( text );
+    if( !readKernel( in, error ) ) return false;
+    normalizeFilter();
+    flipKernel();
+    if( !path.empty() ) storeKernelRecord( path, hash, text.size() );
+    return true;
+}
+
+string kernelCacheDir(){
+    string directory = KERNEL_CACHE;
+    if( directory.empty() && getenv( "CONVOLVE_KERNEL_CACHE" ) ) directory = getenv( "CONVOLVE_KERNEL_CACHE" );
+    if( directory.empty() || directory == "off" ) return "";
+
+    // every missing parent too, like mkdir -p
+    for( size_t slash = directory.find( '/', 1 ); ; slash = directory.find( '/', slash + 1 ) ){
+        mkdir( directory.substr( 0, slash ).c_str(), 0755 );
+        if( slash == string::npos ) break;
+    }
+    struct stat info;
+    if( stat( directory.c_str(), &info ) != 0 || !S_ISDIR( info.st_mode ) ) return "";
+    return directory;
+}
+
+unsigned long long hashText( const string& text ){
+    unsigned long long hash = 14695981039346656037ULL;
+    for( unsigned char c : text ){
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool loadKernelRecord( string path, unsigned long long hash, size_t length ){
+    int fd = open( path.c_str(), O_RDONLY );
+    if( fd < 0 ) return false;
+    struct stat info;
+    void* data = fstat( fd, &info ) == 0 && info.st_size >= ( off_t )sizeof( KernelRecord )
+        ? mmap( NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0 ) : MAP_FAILED;
+    close( fd );
+    if( data == MAP_FAILED ) return false;
+    size_t size = info.st_size;
+
+    const KernelRecord* record = ( const KernelRecord* )data;
+    bool valid = memcmp( record->magic, KERNEL_MAGIC, sizeof( KERNEL_MAGIC ) ) == 0 && record->hash == hash
+        && record->length == length && record->size > 0 && record->size % 2 == 1 && record->boxes >= 0
+        && record->header >= -1 && record->header <= BORDER_WRAP;
+    size_t vectors = valid && ( record->flags & KERNEL_SEPARABLE ) ? 2 * record->size : 0;
+    valid = valid && size == sizeof( KernelRecord ) + ( ( size_t )record->size * record->size + vectors ) * sizeof( float )
+        + record->boxes * sizeof( int );
+    if( valid ){
+        const float* weights = ( const float* )( record + 1 );
+        kernelSIZE = record->size;
+        kernelRADIUS = kernelSIZE / 2;
+        KERNEL.assign( weights, weights + kernelSIZE * kernelSIZE );
+        weights += kernelSIZE * kernelSIZE;
+        kernelSEPARABLE = record->flags & KERNEL_SEPARABLE;
+        kernelCOLUMN.assign( weights, weights + vectors / 2 );
+        kernelROW.assign( weights + vectors / 2, weights + vectors );
+        const int* boxes = ( const int* )( weights + vectors );
+        kernelBOXES.assign( boxes, boxes + record->boxes );
+        kernelHSYMMETRY = record->symmetry[0];
+        kernelVSYMMETRY = record->symmetry[1];
+        kernelPSYMMETRY = record->symmetry[2];
+        // the header border applies unless --border overrides it
+        kernelHEADER = record->header;
+        kernelBORDER = kernelHEADER < 0 || BORDER_OVERRIDE ? BORDER : ( BorderMode )kernelHEADER;
+    }
+    munmap( data, size );
+    return valid;
+}
+
+void storeKernelRecord( string path, unsigned long long hash, size_t length ){
+    KernelRecord record;
+    memcpy( record.magic, KERNEL_MAGIC, sizeof( KERNEL_MAGIC ) );
+    record.hash = hash;
+    record.length = length;
+    record.size = kernelSIZE;
+    record.header = kernelHEADER;
+    record.boxes = kernelBOXES.size();
+    record.flags = kernelSEPARABLE ? KERNEL_SEPARABLE : 0;
+    record.symmetry[0] = kernelHSYMMETRY;
+    record.symmetry[1] = kernelVSYMMETRY;
+    record.symmetry[2] = kernelPSYMMETRY;
+
+    // written aside and renamed into place
+    string temporary = path + "." + to_string( getpid() );
+    ofstream out( temporary, ios::binary );
+    out.write( ( const char* )&record, sizeof( record ) );
+    out.write( ( const char* )&KERNEL[0], KERNEL.size() * sizeof( float ) );
+    if( kernelSEPARABLE ){
+        out.write( ( const char* )&kernelCOLUMN[0], kernelCOLUMN.size() * sizeof( float ) );
+        out.write( ( const char* )&kernelROW[0], kernelROW.size() * sizeof( float ) );
+    }
+    if( !kernelBOXES.empty() ) out.write( ( const char* )&kernelBOXES[0], kernelBOXES.size() * sizeof( int ) );
+    out.close();
+    // a cache that cannot be written only costs the next run a parse
+    if( !out || rename( temporary.c_str(), path.c_str() ) != 0 ) unlink( temporary.c_str() );
+}
@@ -0,0 +1,158 @@
+/*
+    Nearest palette colour lookup.
+
+    Each palette is turned once into a 64 x 64 x 64 table over the top six
+    bits of r, g and b, holding the palette colour nearest to the centre of
+    that cell itself rather than its index, so palettes of any size fit. Mapping an opaque pixel is then one table
+    lookup, whatever the size of the palette. Pixels that are not opaque
+    fall back to an exact search, since the table assumes alpha 255.
+*/
+#include <map>
+#include <sys/stat.h>
+
+// bits of each of r, g and b that index the table
+const int LUT_BITS = 6;
+const int LUT_SIZE = 1 << LUT_BITS;
+
+struct PaletteLUT{
+    vector<Pixel> colors;
+    vector<Pixel> table;
+};
+
+// a decoded palette file and the modification time it was read at
+struct CachedPalette{
+    time_t mtime;
+    PaletteLUT lut;
+};
+
+map<string, CachedPalette> PALETTE_CACHE;
+
+// rows of a region handled as one work item when mapping a grid
+const int BAND_HEIGHT = 32;
+
+/*
+    Squared rgba distance between two colours.
+*/
+inline int colorDistance( const Pixel& a, const Pixel& b ){
+    int dr = a.r - b.r, dg = a.g - b.g, db = a.b - b.b, da = a.a - b.a;
+    return dr * dr + dg * dg + db * db + da * da;
+}
+
+/*
+    Index of the colour of palette nearest to color, by exact search.
+*/
+int nearestColor( const vector<Pixel>& palette, const Pixel& color );
+
+/*
+    Fills lut with the table for palette.
+*/
+void buildPaletteLUT( const vector<Pixel>& palette, PaletteLUT& lut );
+
+/*
+    Replaces every pixel of image in [x0, x1) x [y0, y1) by its nearest
+    colour in lut. An empty palette leaves the region alone.
+*/
+void mapRegion( Pixel** image, const PaletteLUT& lut, int x0, int y0, int x1, int y1 );
+
+/*
+    Splits a width x height image into a columns x rows grid of regions,
+    the first one at the bottom left, and maps the part of region i inside
+    [x0, x1) x [y0, y1) with luts[assignment[i]]. Regions are cut into bands
+    of BAND_HEIGHT rows that are spread over the thread pool, so the work is
+    balanced however many regions there are.
+*/
+void mapPaletteGrid( Pixel** image, int width, int height, const vector<const PaletteLUT*>& luts, int columns, int rows, const vector<int>& assignment,
+                     int x0, int y0, int x1, int y1 );
+
+/*
+    Returns the table for a palette file. The file is only decoded, and the
+    table only built, the first time and whenever its modification time
+    changes. A file that cannot be read gives an empty table, reported once,
+    until it changes.
+*/
+const PaletteLUT& cachedPalette( string palette_file );
+
+
+int nearestColor( const vector<Pixel>& palette, const Pixel& color ){
+    int best = 0;
+    int least_distance = colorDistance( palette[0], color );
+    for( int i=1; i<(int)palette.size(); i++ ){
+        int distance = colorDistance( palette[i], color );
+        if( distance < least_distance ){
+            best = i;
+            least_distance = distance;
+        }
+    }
+    return best;
+}
+
+void buildPaletteLUT( const vector<Pixel>& palette, PaletteLUT& lut ){
+    lut.colors = palette;
+    lut.table.clear();
+    if( palette.empty() ) return;
+
+    lut.table.resize( LUT_SIZE * LUT_SIZE * LUT_SIZE );
+    int shift = 8 - LUT_BITS;
+    int centre = ( 1 << shift ) / 2;
+    parallelFor( LUT_SIZE, [&]( int r ){
+        Pixel cell;
+        cell.a = 255;
+        cell.r = ( r << shift ) + centre;
+        for( int g=0; g<LUT_SIZE; g++ ){
+            cell.g = ( g << shift ) + centre;
+            for( int b=0; b<LUT_SIZE; b++ ){
+                cell.b = ( b << shift ) + centre;
+                lut.table[( r * LUT_SIZE + g ) * LUT_SIZE + b] = palette[nearestColor( palette, cell )];
+            }
+        }
+    });
+}
+
+void mapRegion( Pixel** image, const PaletteLUT& lut, int x0, int y0, int x1, int y1 ){
+    if( lut.colors.empty() ) return;
+    int shift = 8 - LUT_BITS;
+    for( int y=y0; y<y1; y++ )
+        for( int x=x0; x<x1; x++ ){
+            Pixel& pixel = image[y][x];
+            if( pixel.a == 255 )
+                pixel = lut.table[(( pixel.r >> shift ) * LUT_SIZE + ( pixel.g >> shift )) * LUT_SIZE + ( pixel.b >> shift )];
+            else
+                pixel = lut.colors[nearestColor( lut.colors, pixel )];
+        }
+}
+
+void mapPaletteGrid( Pixel** image, int width, int height, const vector<const PaletteLUT*>& luts, int columns, int rows, const vector<int>& assignment,
+                     int x0, int y0, int x1, int y1 ){
+    // band b of a region starts b * BAND_HEIGHT rows above its bottom edge
+    int tallest = ( height + rows - 1 ) / rows;
+    int bands = ( tallest + BAND_HEIGHT - 1 ) / BAND_HEIGHT;
+    parallelFor( columns * rows * bands, [&]( int item ){
+        int region = item / bands;
+        int band = item % bands;
+        int column = region % columns;
+        int row = region / columns;
+
+        int left = max( x0, column * width / columns );
+        int right = min( x1, ( column + 1 ) * width / columns );
+        int bottom = row * height / rows + band * BAND_HEIGHT;
+        int top = min( y1, min( bottom + BAND_HEIGHT, ( row + 1 ) * height / rows ) );
+        bottom = max( bottom, y0 );
+        if( left < right && bottom < top ) mapRegion( image, *luts[assignment[region]], left, bottom, right, top );
+    });
+}
+
+const PaletteLUT& cachedPalette( string palette_file ){
+    struct stat info;
+    time_t mtime = stat( palette_file.c_str(), &info ) == 0 ? info.st_mtime : 0;
+
+    auto cached = PALETTE_CACHE.find( palette_file );
+    if( cached != PALETTE_CACHE.end() && cached->second.mtime == mtime ) return cached->second.lut;
+
+    CachedPalette& entry = PALETTE_CACHE[palette_file];
+    vector<Pixel> colors;
+    // on failure colors stays empty, which mapRegion skips
+    readColorPalette( palette_file, colors );
+    buildPaletteLUT( colors, entry.lut );
+    entry.mtime = mtime;
+    return entry.lut;
+}
@@ -0,0 +1,293 @@
+/*
+    Chains of filters applied one after the other.
+
+    The filter argument may list several .filt files separated by commas,
+    e.g. "filters/lp5.filt,filters/laplacian.filt". Each stage is loaded
+    once, and the stages run back to back between two ping-pong buffers, so
+    no intermediate image is ever encoded.
+
+    A stage may also be given inline as "kernel:" followed by the contents
+    of a .filt file, e.g. "kernel:3 1 2 1 2 4 2 1 2 1".
+*/
+#include <sstream>
+
+/*
+    Everything known about one loaded kernel. The current kernel lives in
+    the KERNEL globals; a Filter holds a copy of them for each stage.
+*/
+struct Filter{
+    string name;
+    int size;
+    vector<float> weights;
+    bool separable;
+    vector<float> column, row;
+    vector<int> boxes;
+    int hsymmetry, vsymmetry, psymmetry;
+    BorderMode border;
+};
+
+vector<Filter> PIPELINE;
+
+// the stages buildPipeline read, before any fusing, so that validation
+// measures against applying them one after the other
+vector<Filter> STAGES;
+
+// set by --fuse: adjacent stages are composed into one kernel where
+// clamping cannot happen in between
+bool FUSE = false;
+
+/*
+    Copies the current kernel globals into a Filter, and back.
+*/
+Filter currentFilter( string name );
+void useFilter( const Filter& filter );
+
+/*
+    Returns the single kernel equivalent to applying first and then second,
+    ignoring clamping and rounding between them. Its radius is the sum of
+    the two radii.
+*/
+Filter composeFilters( const Filter& first, const Filter& second );
+
+/*
+    Multiply-adds per pixel of a filter on its best image size independent
+    path, direct, separable or box.
+*/
+float filterCost( const Filter& filter );
+
+/*
+    Splits a comma separated filter list into its stages.
+*/
+vector<string> pipelineStages( string spec );
+
+/*
+    Parses, normalizes and flips every filter of a comma separated list
+    into PIPELINE, through the kernel cache, fusing stages if FUSE is set. The first stage is left in
+    the kernel globals. Returns false, with the problem in error, if a
+    filter cannot be read.
+*/
+bool buildPipeline( string spec, string& error );
+
+/*
+    Same as buildPipeline, exiting on errors.
+*/
+void loadPipeline( string spec );
+
+/*
+    The methods the stages of PIPELINE run with on a width x height image,
+    joined by '+'.
+*/
+string pipelineMethods( int width, int height );
+
+/*
+    Runs every stage of PIPELINE over src, writing the first stage into
+    first and then alternating between first and second. src is only read
+    and may be second. Returns the buffer that holds the result.
+*/
+Pixel** runPipeline( Pixel** src, Pixel** first, Pixel** second, int width, int height );
+
+/*
+    Runs every stage of STAGES, unfused, over src with the naive floating
+    point reference and compares that with result. Returns the largest
+    difference in any channel, and counts the pixels that differ at all in
+    differing.
+*/
+int validatePipeline( Pixel** src, Pixel** result, int width, int height, long long& differing );
+
+/*
+    Convolves the working image IN in place with the whole pipeline.
+*/
+void convolve();
+
+
+Filter currentFilter( string name ){
+    Filter filter;
+    filter.name = name;
+    filter.size = kernelSIZE;
+    filter.weights = KERNEL;
+    filter.separable = kernelSEPARABLE;
+    filter.column = kernelCOLUMN;
+    filter.row = kernelROW;
+    filter.boxes = kernelBOXES;
+    filter.hsymmetry = kernelHSYMMETRY;
+    filter.vsymmetry = kernelVSYMMETRY;
+    filter.psymmetry = kernelPSYMMETRY;
+    filter.border = kernelBORDER;
+    return filter;
+}
+
+void useFilter( const Filter& filter ){
+    kernelSIZE = filter.size;
+    kernelRADIUS = filter.size / 2;
+    KERNEL = filter.weights;
+    kernelSEPARABLE = filter.separable;
+    kernelCOLUMN = filter.column;
+    kernelROW = filter.row;
+    kernelBOXES = filter.boxes;
+    kernelHSYMMETRY = filter.hsymmetry;
+    kernelVSYMMETRY = filter.vsymmetry;
+    kernelPSYMMETRY = filter.psymmetry;
+    kernelBORDER = filter.border;
+}
+
+Filter composeFilters( const Filter& first, const Filter& second ){
+    // both kernels are already in applied (correlation) order, so the
+    // composed weights are the full 2d convolution of the two arrays
+    int size = first.size + second.size - 1;
+    vector<float> weights( size * size, 0.0f );
+    for( int i=0; i<first.size; i++ )
+        for( int j=0; j<first.size; j++ ){
+            float a = first.weights[i * first.size + j];
+            if( a == 0.0f ) continue;
+            for( int k=0; k<second.size; k++ )
+                for( int l=0; l<second.size; l++ )
+                    weights[( i + k ) * size + j + l] += a * second.weights[k * second.size + l];
+        }
+
+    kernelSIZE = size;
+    kernelRADIUS = size / 2;
+    KERNEL = weights;
+    detectSeparable();
+    return currentFilter( first.name + "*" + second.name );
+}
+
+float filterCost( const Filter& filter ){
+    useFilter( filter );
+    float cost = kernelSEPARABLE ? min( directCost(), separableCost() ) : directCost();
+    return kernelBOXES.empty() ? cost : min( cost, boxCost() );
+}
+
+vector<string> pipelineStages( string spec ){
+    vector<string> stages;
+    size_t start = 0;
+    while( start <= spec.size() ){
+        size_t end = spec.find( ',', start );
+        if( end == string::npos ) end = spec.size();
+        if( end > start ) stages.push_back( spec.substr( start, end - start ) );
+        start = end + 1;
+    }
+    return stages;
+}
+
+bool buildPipeline( string spec, string& error ){
+    PROFILE_SCOPE( "buildPipeline" );
+    PIPELINE.clear();
+    STAGES.clear();
+    for( auto &filter_file : pipelineStages( spec ) ){
+        if( filter_file.compare( 0, 7, "kernel:" ) == 0 ){
+            if( !compileKernel( filter_file.substr( 7 ), error ) ){
+                error += " in inline kernel";
+                return false;
+            }
+        } else {
+            ifstream infile( filter_file );
+            if( !infile ){
+                error = "Failed to open filter file: " + filter_file;
+                return false;
+            }
+            stringstream text;
+            text << infile.rdbuf();
+            if( !compileKernel( text.str(), error ) ){
+                error += " in filter file: " + filter_file;
+                return false;
+            }
+        }
+        Filter stage = currentFilter( filter_file );
+        STAGES.push_back( stage );
+
+        // a kernel without negative weights is normalized to sum to one, so
+        // its output never leaves [0, 255] and needs no clamping before the
+        // next stage. Only the kernelRADIUS wide border band and the
+        // rounding of the intermediate image differ once fused. Stages with
+        // different borders are kept apart
+        bool clampless = !PIPELINE.empty() && PIPELINE.back().border == stage.border;
+        if( clampless )
+            for( auto &weight : PIPELINE.back().weights )
+                if( weight < 0.0f ) clampless = false;
+
+        if( FUSE && clampless ){
+            // only worth it if the composed kernel is cheaper than two passes
+            float separate = filterCost( PIPELINE.back() ) + filterCost( stage );
+            Filter fused = composeFilters( PIPELINE.back(), stage );
+            if( filterCost( fused ) <= separate ){
+                PIPELINE.back() = fused;
+                continue;
+            }
+        }
+        PIPELINE.push_back( stage );
+    }
+
+    if( PIPELINE.empty() ){
+        error = "No filter files in: " + spec;
+        return false;
+    }
+    useFilter( PIPELINE[0] );
+    return true;
+}
+
+void loadPipeline( string spec ){
+    string error;
+    if( !buildPipeline( spec, error ) ){
+        cerr << error << ". Exiting... " << endl;
+        exit( 1 );
+    }
+}
+
+string pipelineMethods( int width, int height ){
+    string methods;
+    for( auto &stage : PIPELINE ){
+        useFilter( stage );
+        if( !methods.empty() ) methods += "+";
+        methods += methodName( chooseMethod( width, height ) );
+    }
+    useFilter( PIPELINE[0] );
+    return methods;
+}
+
+Pixel** runPipeline( Pixel** src, Pixel** first, Pixel** second, int width, int height ){
+    Pixel** out = first;
+    for( auto &stage : PIPELINE ){
+        useFilter( stage );
+        applyKernel( src, out, width, height );
+        src = out;
+        out = out == first ? second : first;
+    }
+    useFilter( PIPELINE[0] );
+    return src;
+}
+
+int validatePipeline( Pixel** src, Pixel** result, int width, int height, long long& differing ){
+    Image first( width, height ), second( width, height );
+    ConvolveMethod method = METHOD;
+    METHOD = METHOD_NAIVE;
+    // fusing changes the border band, which the report has to show
+    PIPELINE.swap( STAGES );
+    Pixel** reference = runPipeline( src, first.pixels, second.pixels, width, height );
+    PIPELINE.swap( STAGES );
+    useFilter( PIPELINE[0] );
+    METHOD = method;
+
+    int deviation = 0;
+    differing = 0;
+    for( int y=0; y<height; y++ )
+        for( int x=0; x<width; x++ ){
+            int r = abs( result[y][x].r - reference[y][x].r );
+            int g = abs( result[y][x].g - reference[y][x].g );
+            int b = abs( result[y][x].b - reference[y][x].b );
+            int most = max( r, max( g, b ) );
+            if( most > 0 ) differing++;
+            deviation = max( deviation, most );
+        }
+    return deviation;
+}
+
+void convolve(){
+    if( !IN || PIPELINE.empty() ) return;
+    ensureWorkBuffers();
+
+    // ORIGINAL is only ever read, so the stages ping-pong between the work
+    // buffers, starting with whichever one IN is not
+    Pixel** first = IN == WORK.pixels ? SCRATCH.pixels : WORK.pixels;
+    Pixel** second = first == WORK.pixels ? SCRATCH.pixels : WORK.pixels;
+    IN = runPipeline( IN, first, second, imWIDTH, imHEIGHT );
+}
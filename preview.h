@@ -0,0 +1,231 @@
+/*
+    Progressive convolution for the interactive window.
+
+    readImage halves ORIGINAL over and over into PYRAMID. When 'c' is pressed
+    and the window shows the image scaled down, the pipeline first runs on
+    the smallest level that still covers the viewport, which is shown right
+    away, while a background thread convolves the full resolution image.
+    The preview is an approximation, the kernel covers more of the picture
+    at the smaller level, and the full result replaces it as soon as it is
+    ready.
+
+    Pressing 'c' again while refining previews the extra pass at once and
+    restarts the refinement with one more pass. A pass of the source that
+    incremental.h can bring up to date cheaply skips the preview. Resetting, loading another
+    image or quitting cancels the refinement. Saving and mapping the palette
+    wait for it, since they need the full resolution image.
+*/
+#include <atomic>
+
+// set in interactive mode, where readImage builds the pyramid and 'c' previews
+bool PROGRESSIVE = false;
+
+const int PYRAMID_LEVELS = 16;
+
+// PYRAMID[l] is ORIGINAL halved l times, for l from 1 up to pyramidLEVELS - 1
+Image PYRAMID[PYRAMID_LEVELS];
+int pyramidLEVELS = 0;
+
+// what the window shows while the refinement runs
+Image PREVIEW;
+
+// the buffers the refinement convolves into, and the one it ended up in
+Image REFINED[2];
+Pixel** refinedRESULT = NULL;
+
+// the refinement thread, the pipeline passes it applies to IN, and whether
+// it is through. Timers of earlier refinements see another generation
+thread REFINER;
+int refinePASSES = 0;
+int refineGENERATION = 0;
+atomic<bool> REFINE_DONE( false );
+
+/*
+    Builds the pyramid of ORIGINAL, when PROGRESSIVE is set.
+*/
+void buildPyramid();
+
+/*
+    Averages each 2x2 block of the width x height pixmap src into dst, which
+    ends up half as big, rounded up.
+*/
+void halve( Pixel** src, int width, int height, Image& dst );
+
+/*
+    The pyramid level whose size matches the viewport, the smallest that
+    still covers it. 0 means the image is shown at full size.
+*/
+int previewLevel();
+
+/*
+    Convolves the image shown in the window, first at the preview level
+    and then at full resolution in the background.
+*/
+void progressiveConvolve();
+
+/*
+    Body of the refinement thread: applies passes pipeline passes to IN.
+*/
+void refine( int passes );
+
+/*
+    Whether a refinement is running, and the window shows the preview.
+*/
+bool refining();
+
+/*
+    Stops the refinement if there is one. With cancel it is abandoned,
+    otherwise it is waited for and its result becomes IN.
+*/
+void stopRefinement( bool cancel );
+
+/*
+    GLUT timer polling the refinement of generation, which shows the full
+    result once it is in.
+*/
+void checkRefinement( int generation );
+
+
+void buildPyramid(){
+    pyramidLEVELS = 1;
+    if( !PROGRESSIVE ) return;
+    PROFILE_SCOPE( "buildPyramid" );
+    Pixel** level = ORIGINAL.pixels;
+    int width = imWIDTH, height = imHEIGHT;
+    while( pyramidLEVELS < PYRAMID_LEVELS && ( width > 1 || height > 1 ) ){
+        Image& next = PYRAMID[pyramidLEVELS++];
+        halve( level, width, height, next );
+        level = next.pixels;
+        width = next.width;
+        height = next.height;
+    }
+}
+
+void halve( Pixel** src, int width, int height, Image& dst ){
+    dst.resize( ( width + 1 ) / 2, ( height + 1 ) / 2 );
+    parallelFor( dst.height, [&]( int y ){
+        // an odd last row or column pairs with itself
+        const Pixel* top = src[min( 2 * y + 1, height - 1 )];
+        const Pixel* bottom = src[2 * y];
+        for( int x=0; x<dst.width; x++ ){
+            int left = 2 * x, right = min( 2 * x + 1, width - 1 );
+            for( int c=0; c<4; c++ ){
+                int sum = ( &bottom[left].r )[c] + ( &bottom[right].r )[c] + ( &top[left].r )[c] + ( &top[right].r )[c];
+                ( &dst.pixels[y][x].r )[c] = ( sum + 2 ) / 4;
+            }
+        }
+    });
+}
+
+int previewLevel(){
+    int level = 0;
+    int width = imWIDTH, height = imHEIGHT;
+    while( level + 1 < pyramidLEVELS && ( width + 1 ) / 2 >= vpWIDTH && ( height + 1 ) / 2 >= vpHEIGHT ){
+        width = ( width + 1 ) / 2;
+        height = ( height + 1 ) / 2;
+        level++;
+    }
+    return level;
+}
+
+void progressiveConvolve(){
+    if( !IN || PIPELINE.empty() ) return;
+    // a refinement that is through only needs picking up, one still
+    // running starts over with the extra pass
+    if( REFINE_DONE ) stopRefinement( false );
+    int passes = refinePASSES;
+    stopRefinement( true );
+
+    // the source with a pass of it already at hand only needs its edits
+    // convolved
+    if( passes == 0 && convolveIncrementally() ) return;
+
+    int level = previewLevel();
+    if( level == 0 ){
+        // nothing to gain, the window shows every pixel
+        bool single = passes == 0 && IN == SOURCE;
+        for( int i=0; i<passes+1; i++ ) convolve();
+        if( single ) keepConvolution();
+        markStale( imageRect() );
+        return;
+    }
+
+    // the preview starts from IN at the level, unless it already shows
+    // the passes still to be refined
+    if( passes == 0 ){
+        PROFILE_SCOPE( "previewLevel" );
+        if( IN == ORIGINAL.pixels ){
+            Image& source = PYRAMID[level];
+            PREVIEW.resize( source.width, source.height );
+            memcpy( PREVIEW.pixels[0], source.pixels[0], ( size_t )source.width * source.height * sizeof( Pixel ) );
+        } else {
+            Image smaller;
+            halve( IN, imWIDTH, imHEIGHT, PREVIEW );
+            for( int i=1; i<level; i++ ){
+                halve( PREVIEW.pixels, PREVIEW.width, PREVIEW.height, smaller );
+                PREVIEW.resize( smaller.width, smaller.height );
+                memcpy( PREVIEW.pixels[0], smaller.pixels[0], ( size_t )smaller.width * smaller.height * sizeof( Pixel ) );
+            }
+        }
+    }
+    {
+        PROFILE_SCOPE( "preview" );
+        Image first( PREVIEW.width, PREVIEW.height ), second( PREVIEW.width, PREVIEW.height );
+        Pixel** result = runPipeline( PREVIEW.pixels, first.pixels, second.pixels, PREVIEW.width, PREVIEW.height );
+        memcpy( PREVIEW.pixels[0], result[0], ( size_t )PREVIEW.width * PREVIEW.height * sizeof( Pixel ) );
+    }
+
+    refinePASSES = passes + 1;
+    REFINED[0].resize( imWIDTH, imHEIGHT );
+    REFINED[1].resize( imWIDTH, imHEIGHT );
+    REFINER = thread( refine, refinePASSES );
+    glutTimerFunc( 20, checkRefinement, ++refineGENERATION );
+}
+
+void refine( int passes ){
+    PROFILE_SCOPE( "refine" );
+    Pixel** src = IN;
+    for( int i=0; i<passes && !CANCELLED; i++ ){
+        Pixel** first = src == REFINED[0].pixels ? REFINED[1].pixels : REFINED[0].pixels;
+        Pixel** second = first == REFINED[0].pixels ? REFINED[1].pixels : REFINED[0].pixels;
+        src = runPipeline( src, first, second, imWIDTH, imHEIGHT );
+    }
+    refinedRESULT = src;
+    REFINE_DONE = true;
+}
+
+bool refining(){
+    return REFINER.joinable();
+}
+
+void stopRefinement( bool cancel ){
+    if( !REFINER.joinable() ) return;
+    if( cancel ) CANCELLED = true;
+    REFINER.join();
+    REFINE_DONE = false;
+    int passes = refinePASSES;
+    refinePASSES = 0;
+    if( !cancel && passes == 1 && IN == SOURCE ){
+        // a single pass over the source is kept for incremental updates
+        IN = refinedRESULT;
+        keepConvolution();
+    } else if( !cancel ){
+        // into whichever work buffer IN is not, as convolve would have
+        ensureWorkBuffers();
+        Pixel** target = IN == WORK.pixels ? SCRATCH.pixels : WORK.pixels;
+        memcpy( target[0], refinedRESULT[0], ( size_t )imWIDTH * imHEIGHT * sizeof( Pixel ) );
+        IN = target;
+        markStale( imageRect() );
+    }
+    CANCELLED = false;
+}
+
+void checkRefinement( int generation ){
+    if( !REFINER.joinable() || generation != refineGENERATION ) return;
+    if( !REFINE_DONE ){
+        glutTimerFunc( 20, checkRefinement, generation );
+        return;
+    }
+    stopRefinement( false );
+    glutPostRedisplay();
+}
@@ -0,0 +1,171 @@
+/*
+    Lightweight instrumentation of the hot paths.
+
+    Build with -DPROFILE (make PROFILE=1) to turn it on. Scoped timers then
+    record every phase they cover, and counters add up pixels, bytes and
+    kernel multiply-adds. A summary is printed to stderr at exit, and a
+    Chrome trace (chrome://tracing, Perfetto) is written to the file named
+    by --trace or the CONVOLVE_TRACE environment variable.
+
+    Without PROFILE the macros expand to nothing, arguments included.
+*/
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <map>
+
+enum Counter{ COUNT_PIXELS, COUNT_BYTES_READ, COUNT_BYTES_WRITTEN, COUNT_BYTES_UPLOADED, COUNT_MACS, COUNTERS };
+
+// trace file from --trace, CONVOLVE_TRACE is used when it is empty
+string TRACE_FILE = "";
+
+// events kept for the trace, about 24 MB of them. A server running for
+// days would otherwise grow without end; the summary counts every event
+const size_t TRACE_EVENTS = 1 << 20;
+
+#ifdef PROFILE
+
+#define PROFILE_JOIN2( a, b ) a##b
+#define PROFILE_JOIN( a, b ) PROFILE_JOIN2( a, b )
+#define PROFILE_SCOPE( name ) ScopedTimer PROFILE_JOIN( profile_timer_, __LINE__ )( name )
+#define PROFILE_COUNT( counter, amount ) profileCount( counter, amount )
+
+// one finished timer, in microseconds since the program started
+struct TraceEvent{
+    const char* name;
+    int thread;
+    long long start, duration;
+};
+
+/*
+    Records the time from its construction to the end of the scope.
+*/
+class ScopedTimer{
+public:
+    ScopedTimer( const char* name );
+    ~ScopedTimer();
+private:
+    const char* name;
+    chrono::steady_clock::time_point start;
+};
+
+/*
+    Collects the events and counters and reports them at exit.
+*/
+class Profile{
+public:
+    Profile();
+    ~Profile();
+
+    void record( const TraceEvent& event );
+
+    atomic<long long> counters[COUNTERS];
+private:
+    void printSummary();
+    void writeTrace( string filename );
+
+    chrono::steady_clock::time_point epoch;
+    mutex lock;
+    vector<TraceEvent> events;
+    // total time and count of every phase, and the events left out of the trace
+    map<const char*, pair<long long, long long>> phases;
+    long long dropped = 0;
+    map<thread::id, int> threads;
+    friend class ScopedTimer;
+};
+
+Profile PROFILER;
+
+/*
+    Adds amount to one of the counters.
+*/
+inline void profileCount( Counter counter, long long amount ){
+    PROFILER.counters[counter] += amount;
+}
+
+
+ScopedTimer::ScopedTimer( const char* name ) : name( name ), start( chrono::steady_clock::now() ){}
+
+ScopedTimer::~ScopedTimer(){
+    auto stop = chrono::steady_clock::now();
+    TraceEvent event;
+    event.name = name;
+    event.thread = 0;
+    event.start = chrono::duration_cast<chrono::microseconds>( start - PROFILER.epoch ).count();
+    event.duration = chrono::duration_cast<chrono::microseconds>( stop - start ).count();
+    PROFILER.record( event );
+}
+
+Profile::Profile() : epoch( chrono::steady_clock::now() ){
+    for( auto &counter : counters ) counter = 0;
+}
+
+Profile::~Profile(){
+    printSummary();
+    string filename = TRACE_FILE;
+    if( filename.empty() && getenv( "CONVOLVE_TRACE" ) ) filename = getenv( "CONVOLVE_TRACE" );
+    if( !filename.empty() ) writeTrace( filename );
+}
+
+void Profile::record( const TraceEvent& event ){
+    lock_guard<mutex> guard( lock );
+    // threads are numbered in the order they first report
+    auto id = this_thread::get_id();
+    if( !threads.count( id ) ){
+        int number = threads.size();
+        threads[id] = number;
+    }
+    phases[event.name].first += event.duration;
+    phases[event.name].second++;
+    if( events.size() >= TRACE_EVENTS ){
+        dropped++;
+        return;
+    }
+    events.push_back( event );
+    events.back().thread = threads[id];
+}
+
+void Profile::printSummary(){
+    // the same name may sit at more than one address, so merge by name
+    map<string, pair<long long, long long>> totals;
+    for( auto &phase : phases ){
+        totals[phase.first].first += phase.second.first;
+        totals[phase.first].second += phase.second.second;
+    }
+
+    cerr << "profile:" << endl;
+    for( auto &phase : totals )
+        cerr << "  " << phase.first << ": " << phase.second.first / 1000.0 << " ms in " << phase.second.second << " calls" << endl;
+    if( dropped > 0 ) cerr << "  events left out of the trace: " << dropped << endl;
+    cerr << "  pixels processed: " << counters[COUNT_PIXELS] << endl;
+    cerr << "  bytes read: " << counters[COUNT_BYTES_READ] << endl;
+    cerr << "  bytes written: " << counters[COUNT_BYTES_WRITTEN] << endl;
+    cerr << "  bytes uploaded: " << counters[COUNT_BYTES_UPLOADED] << endl;
+    cerr << "  kernel multiply-adds: " << counters[COUNT_MACS] << endl;
+}
+
+void Profile::writeTrace( string filename ){
+    ofstream outfile( filename );
+    if( !outfile ){
+        cerr << "Failed to open trace file: " << filename << endl;
+        return;
+    }
+    outfile << "{\"traceEvents\": [" << endl;
+    for( size_t i=0; i<events.size(); i++ )
+        outfile << "  {\"name\": \"" << events[i].name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << events[i].thread
+                << ", \"ts\": " << events[i].start << ", \"dur\": " << events[i].duration << "},"  << endl;
+    // counters go in as one final counter event
+    outfile << "  {\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, \"tid\": 0, \"ts\": 0, \"args\": {"
+            << "\"pixels\": " << counters[COUNT_PIXELS] << ", \"bytes_read\": " << counters[COUNT_BYTES_READ]
+            << ", \"bytes_written\": " << counters[COUNT_BYTES_WRITTEN]
+            << ", \"bytes_uploaded\": " << counters[COUNT_BYTES_UPLOADED] << ", \"macs\": " << counters[COUNT_MACS] << "}}" << endl;
+    outfile << "]}" << endl;
+}
+
+#else
+
+#define PROFILE_SCOPE( name )
+#define PROFILE_COUNT( counter, amount )
+
+#endif
@@ -0,0 +1,302 @@
+/*
+    Uncompressed image files, read and written through mmap.
+
+    Meant for the intermediate files of longer pipelines, where PNG
+    compression costs more than the convolution. Three formats are handled
+    here instead of by OpenImageIO, picked by extension:
+
+        .ppm    binary P6 rgb, maxval 255
+        .pgm    binary P5 grey, maxval 255
+        .raw    a RAW_HEADER byte text header "CVRAW width height", padded
+                with spaces and ending in a newline, followed by rgba pixels
+                bottom scanline first, the layout of a pixmap
+
+    A .raw input is not copied at all: the pixmap rows point into the mapped
+    pages. A .raw output is mapped before convolving, and the last stage
+    writes straight into it. PPM and PGM have no alpha, which is dropped on
+    writing, and PGM keeps the luma of the rgb channels.
+*/
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// size of the .raw header, which keeps the pixels aligned
+const int RAW_HEADER = 64;
+
+/*
+    Whether filename is a .raw file, and whether it is any of the formats
+    handled here.
+*/
+bool isRawFile( string filename );
+bool isMappedFormat( string filename );
+
+/*
+    Reads a .ppm, .pgm or .raw file into ORIGINAL, the same way readImage
+    does. Returns false, with the problem in error, if the file is missing,
+    truncated or malformed, and false, leaving everything alone and error
+    untouched, for PPM and PGM files that are not 8 bit, so OpenImageIO can
+    read those.
+*/
+bool readMapped( string input_file, string& error );
+
+/*
+    Writes a pixmap, stored bottom scanline first, into a .ppm, .pgm or
+    .raw file through a mapping of the preallocated file. Returns false,
+    with the problem in error, if the file cannot be created.
+*/
+bool writeMapped( string output_file, Pixel** pixmap, int width, int height, string& error );
+
+/*
+    Creates a width x height .raw file and returns a pixmap over its mapped
+    pixels. Whatever is written into the pixmap ends up in the file once
+    deletePixmap lets go of it. Returns NULL, with the problem in error, if
+    the file cannot be created.
+*/
+Pixel** mapOutput( string output_file, int width, int height, string& error );
+
+/*
+    Convolves IN with the whole pipeline straight into a .raw file. IN is
+    left as it is, and must not be mapped from output_file, see sameFile.
+*/
+void convolveToFile( string output_file );
+
+/*
+    Whether the paths a and b name the same existing file, links included.
+*/
+bool sameFile( string a, string b );
+
+/*
+    Unmaps the file behind pixmap, if there is one. Returns whether there was.
+*/
+bool unmapPixmap( Pixel** pixmap );
+
+/*
+    Skips whitespace and # comments from data[at] on, then reads a decimal
+    number. Returns -1 if there is none.
+*/
+int headerNumber( const unsigned char* data, size_t size, size_t& at );
+
+/*
+    Creates output_file at size bytes and maps it for writing. Returns NULL,
+    with the problem in error, if it cannot.
+*/
+unsigned char* mapNewFile( string output_file, size_t size, string& error );
+
+
+bool isRawFile( string filename ){
+    return filename.size() > 4 && filename.compare( filename.size() - 4, 4, ".raw" ) == 0;
+}
+
+bool isMappedFormat( string filename ){
+    if( filename.size() <= 4 ) return false;
+    string extension = filename.substr( filename.size() - 4 );
+    return extension == ".raw" || extension == ".ppm" || extension == ".pgm";
+}
+
+int headerNumber( const unsigned char* data, size_t size, size_t& at ){
+    while( at < size && ( isspace( data[at] ) || data[at] == '#' ) ){
+        if( data[at] == '#' ) while( at < size && data[at] != '\n' ) at++;
+        else at++;
+    }
+    if( at >= size || !isdigit( data[at] ) ) return -1;
+    int number = 0;
+    while( at < size && isdigit( data[at] ) && number < 1000000 ) number = number * 10 + ( data[at++] - '0' );
+    return number;
+}
+
+bool readMapped( string input_file, string& error ){
+    PROFILE_SCOPE( "readMapped" );
+    int fd = open( input_file.c_str(), O_RDONLY );
+    struct stat info;
+    if( fd < 0 || fstat( fd, &info ) != 0 ){
+        if( fd >= 0 ) close( fd );
+        error = "Failed to open input file: " + input_file;
+        return false;
+    }
+    size_t size = info.st_size;
+    // private and writable, so even a stray write would never reach the file
+    void* data = size > 0 ? mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 ) : MAP_FAILED;
+    close( fd );
+    if( data == MAP_FAILED ){
+        error = "Failed to map input file: " + input_file;
+        return false;
+    }
+    const unsigned char* bytes = ( const unsigned char* )data;
+
+    int width, height;
+    if( isRawFile( input_file ) ){
+        // the mapping has no terminating zero, so the header is parsed from
+        // a copy, which also keeps sscanf from running over the pixels
+        char header[RAW_HEADER + 1] = "";
+        if( size >= RAW_HEADER ){
+            memcpy( header, bytes, RAW_HEADER );
+            header[RAW_HEADER] = '\0';
+        }
+        if( size < RAW_HEADER || sscanf( header, "CVRAW %d %d", &width, &height ) != 2 || width < 1 || height < 1
+            || size < RAW_HEADER + ( size_t )width * height * sizeof( Pixel ) ){
+            munmap( data, size );
+            error = "Invalid raw file: " + input_file;
+            return false;
+        }
+
+        // the pixels are used where they are
+        Pixel** rows = new Pixel*[height];
+        rows[0] = ( Pixel* )( bytes + RAW_HEADER );
+        for( int i=1; i<height; i++ ) rows[i] = rows[i-1] + width;
+        Mapping mapping = { data, size };
+        MAPPINGS[rows] = mapping;
+        ORIGINAL.adopt( rows, width, height );
+        CHANNELS = 4;
+    } else {
+        size_t at = 2;
+        int maxval = -1;
+        bool grey = size > 2 && bytes[0] == 'P' && bytes[1] == '5';
+        bool rgb = size > 2 && bytes[0] == 'P' && bytes[1] == '6';
+        width = height = -1;
+        if( grey || rgb ){
+            width = headerNumber( bytes, size, at );
+            height = headerNumber( bytes, size, at );
+            maxval = headerNumber( bytes, size, at );
+        }
+        // a single whitespace character separates the header from the pixels
+        at++;
+        int channels = grey ? 1 : 3;
+        if( width < 1 || height < 1 || maxval != 255 || size < at + ( size_t )width * height * channels ){
+            munmap( data, size );
+            if( ( grey || rgb ) && maxval > 255 ) return false;
+            error = "Invalid or truncated file: " + input_file;
+            return false;
+        }
+        CHANNELS = channels;
+
+        // the file has the top scanline first
+        ORIGINAL.resize( width, height );
+        Pixel** image = ORIGINAL.pixels;
+        const unsigned char* pixels = bytes + at;
+        parallelFor( height, [&]( int y ){
+            const unsigned char* source = pixels + ( size_t )( height - 1 - y ) * width * channels;
+            Pixel* row = image[y];
+            for( int x=0; x<width; x++ ){
+                const unsigned char* pixel = source + x * channels;
+                row[x].r = pixel[0];
+                row[x].g = channels == 3 ? pixel[1] : pixel[0];
+                row[x].b = channels == 3 ? pixel[2] : pixel[0];
+                row[x].a = 255;
+            }
+        });
+        munmap( data, size );
+    }
+
+    imWIDTH = width;
+    imHEIGHT = height;
+    winWIDTH = imWIDTH;
+    winHEIGHT = imHEIGHT;
+    IN = ORIGINAL.pixels;
+    PROFILE_COUNT( COUNT_BYTES_READ, (long long)imWIDTH * imHEIGHT * CHANNELS );
+    pixel_format = GL_RGBA;
+    CHANNELS = 4;
+    return true;
+}
+
+unsigned char* mapNewFile( string output_file, size_t size, string& error ){
+    int fd = open( output_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 || ftruncate( fd, size ) != 0 ){
+        if( fd >= 0 ) close( fd );
+        error = "Failed to create output file: " + output_file;
+        return NULL;
+    }
+    void* data = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( data == MAP_FAILED ){
+        error = "Failed to map output file: " + output_file;
+        return NULL;
+    }
+    return ( unsigned char* )data;
+}
+
+bool writeMapped( string output_file, Pixel** pixmap, int width, int height, string& error ){
+    PROFILE_SCOPE( "writeMapped" );
+    if( isRawFile( output_file ) ){
+        Pixel** target = mapOutput( output_file, width, height, error );
+        if( !target ) return false;
+        memcpy( target[0], pixmap[0], ( size_t )width * height * sizeof( Pixel ) );
+        deletePixmap( target );
+        PROFILE_COUNT( COUNT_BYTES_WRITTEN, (long long)width * height * sizeof( Pixel ) );
+        return true;
+    }
+
+    bool grey = output_file.compare( output_file.size() - 4, 4, ".pgm" ) == 0;
+    int channels = grey ? 1 : 3;
+    string header = string( grey ? "P5" : "P6" ) + "\n" + to_string( width ) + " " + to_string( height ) + "\n255\n";
+    size_t size = header.size() + ( size_t )width * height * channels;
+    unsigned char* data = mapNewFile( output_file, size, error );
+    if( !data ) return false;
+    memcpy( data, header.data(), header.size() );
+
+    unsigned char* pixels = data + header.size();
+    parallelFor( height, [&]( int y ){
+        unsigned char* target = pixels + ( size_t )( height - 1 - y ) * width * channels;
+        const Pixel* row = pixmap[y];
+        for( int x=0; x<width; x++ ){
+            if( grey ){
+                target[x] = ( 299 * row[x].r + 587 * row[x].g + 114 * row[x].b + 500 ) / 1000;
+            } else {
+                target[3 * x] = row[x].r;
+                target[3 * x + 1] = row[x].g;
+                target[3 * x + 2] = row[x].b;
+            }
+        }
+    });
+    munmap( data, size );
+    PROFILE_COUNT( COUNT_BYTES_WRITTEN, (long long)size );
+    return true;
+}
+
+Pixel** mapOutput( string output_file, int width, int height, string& error ){
+    size_t size = RAW_HEADER + ( size_t )width * height * sizeof( Pixel );
+    unsigned char* data = mapNewFile( output_file, size, error );
+    if( !data ) return NULL;
+    memset( data, ' ', RAW_HEADER );
+    int length = snprintf( ( char* )data, RAW_HEADER, "CVRAW %d %d", width, height );
+    data[length] = ' ';
+    data[RAW_HEADER - 1] = '\n';
+
+    Pixel** pixmap = new Pixel*[height];
+    pixmap[0] = ( Pixel* )( data + RAW_HEADER );
+    for( int i=1; i<height; i++ ) pixmap[i] = pixmap[i-1] + width;
+    Mapping mapping = { data, size };
+    MAPPINGS[pixmap] = mapping;
+    return pixmap;
+}
+
+void convolveToFile( string output_file ){
+    string error;
+    Pixel** target = mapOutput( output_file, imWIDTH, imHEIGHT, error );
+    if( !target ){
+        cerr << error << ". Exiting... " << endl;
+        exit( 1 );
+    }
+    ensureWorkBuffers();
+    // runPipeline writes the odd stages into its first buffer and the even
+    // ones into its second, so the file goes where the last stage lands
+    Pixel** other = IN == WORK.pixels ? SCRATCH.pixels : WORK.pixels;
+    if( PIPELINE.size() % 2 == 1 ) runPipeline( IN, target, other, imWIDTH, imHEIGHT );
+    else runPipeline( IN, other, target, imWIDTH, imHEIGHT );
+    deletePixmap( target );
+    PROFILE_COUNT( COUNT_BYTES_WRITTEN, (long long)imWIDTH * imHEIGHT * sizeof( Pixel ) );
+}
+
+bool sameFile( string a, string b ){
+    struct stat first, second;
+    if( stat( a.c_str(), &first ) != 0 || stat( b.c_str(), &second ) != 0 ) return false;
+    return first.st_dev == second.st_dev && first.st_ino == second.st_ino;
+}
+
+bool unmapPixmap( Pixel** pixmap ){
+    auto mapped = MAPPINGS.find( pixmap );
+    if( mapped == MAPPINGS.end() ) return false;
+    munmap( mapped->second.data, mapped->second.size );
+    MAPPINGS.erase( mapped );
+    return true;
+}
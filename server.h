@@ -0,0 +1,251 @@
+/*
+    Convolution server.
+
+    convolve --serve SOCKET listens on a Unix domain socket and takes jobs,
+    one per line, each made of three tab separated fields:
+
+        input<TAB>filter<TAB>output
+
+    where filter is anything loadPipeline takes, inline kernels included.
+    Each job is answered with one line, "ok QUEUE_MS RUN_MS METHODS" or
+    "error MESSAGE". A fixed set of SERVE_CLIENTS threads take turns
+    accepting clients, so at most that many are connected at once and the
+    rest wait in the listen backlog. The convolution state is global, so
+    the jobs still run one at a time: throughput comes from each job being
+    spread over the whole thread pool, not from running jobs side by side.
+    Parsed pipelines are kept in a least recently used cache, so a filter
+    is read only once however many jobs use it.
+
+    SIGINT and SIGTERM let the running job finish, remove the socket and
+    exit normally, which is also when a PROFILE build writes its summary
+    and trace.
+*/
+#include <list>
+#include <map>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// pipelines kept parsed by the server
+const size_t PIPELINE_CACHE_SIZE = 64;
+
+// clients served at once, and the seconds a client may stay silent before
+// it is hung up on, so that idle connections cannot hold every thread
+const int SERVE_CLIENTS = 8;
+const int CLIENT_TIMEOUT = 60;
+
+// a parsed pipeline and the newest modification time of its filter files
+struct CachedPipeline{
+    string spec;
+    time_t mtime;
+    vector<Filter> stages;
+};
+
+// most recently used first, with an index by spec
+list<CachedPipeline> PIPELINE_CACHE;
+map<string, list<CachedPipeline>::iterator> PIPELINE_INDEX;
+
+// the convolution state is global, so jobs take turns
+mutex JOB_LOCK;
+
+// the signal handler writes a byte into the first, awaitShutdown reads it
+// from the second
+int SHUTDOWN_PIPE[2] = { -1, -1 };
+
+/*
+    Newest modification time of the filter files of spec, 0 for inline
+    kernels and missing files.
+*/
+time_t pipelineTime( string spec );
+
+/*
+    Makes spec the current PIPELINE, from the cache if it is there and its
+    files have not changed since. Returns false, with the problem in error,
+    if it cannot be loaded.
+*/
+bool cachedPipeline( string spec, string& error );
+
+/*
+    Runs one job line and returns the reply, without the newline.
+*/
+string runJob( string job );
+
+/*
+    Answers the jobs of one client until it hangs up or times out.
+*/
+void serveClient( int client );
+
+/*
+    Accepts clients on listener and serves them one after the other, forever.
+*/
+void acceptClients( int listener );
+
+/*
+    Signal handler for SIGINT and SIGTERM. It only wakes awaitShutdown, as
+    little else is safe in a handler.
+*/
+void requestShutdown( int signal );
+
+/*
+    Waits for requestShutdown, then for the running job, and exits after
+    removing socket_path.
+*/
+void awaitShutdown( string socket_path );
+
+/*
+    Listens on socket_path and serves clients until interrupted.
+*/
+void serve( string socket_path );
+
+
+time_t pipelineTime( string spec ){
+    time_t newest = 0;
+    for( auto &stage : pipelineStages( spec ) ){
+        struct stat info;
+        if( stage.compare( 0, 7, "kernel:" ) != 0 && stat( stage.c_str(), &info ) == 0 )
+            newest = max( newest, info.st_mtime );
+    }
+    return newest;
+}
+
+bool cachedPipeline( string spec, string& error ){
+    time_t mtime = pipelineTime( spec );
+    auto cached = PIPELINE_INDEX.find( spec );
+    if( cached != PIPELINE_INDEX.end() ){
+        if( cached->second->mtime == mtime ){
+            PIPELINE_CACHE.splice( PIPELINE_CACHE.begin(), PIPELINE_CACHE, cached->second );
+            PIPELINE = PIPELINE_CACHE.front().stages;
+            useFilter( PIPELINE[0] );
+            return true;
+        }
+        PIPELINE_CACHE.erase( cached->second );
+        PIPELINE_INDEX.erase( cached );
+    }
+
+    if( !buildPipeline( spec, error ) ) return false;
+    CachedPipeline entry;
+    entry.spec = spec;
+    entry.mtime = mtime;
+    entry.stages = PIPELINE;
+    PIPELINE_CACHE.push_front( entry );
+    PIPELINE_INDEX[spec] = PIPELINE_CACHE.begin();
+    if( PIPELINE_CACHE.size() > PIPELINE_CACHE_SIZE ){
+        PIPELINE_INDEX.erase( PIPELINE_CACHE.back().spec );
+        PIPELINE_CACHE.pop_back();
+    }
+    return true;
+}
+
+string runJob( string job ){
+    auto received = chrono::steady_clock::now();
+    size_t first = job.find( '\t' );
+    size_t second = first == string::npos ? string::npos : job.find( '\t', first + 1 );
+    if( second == string::npos ) return "error Expected input<TAB>filter<TAB>output";
+    string input = job.substr( 0, first );
+    string spec = job.substr( first + 1, second - first - 1 );
+    string output = job.substr( second + 1 );
+
+    lock_guard<mutex> guard( JOB_LOCK );
+    auto started = chrono::steady_clock::now();
+    PROFILE_SCOPE( "job" );
+
+    // loadImage and savePixmap, unlike readImage and writePixmap, report
+    // bad files instead of exiting, which would take the server down
+    string error;
+    if( !cachedPipeline( spec, error ) || !loadImage( input, error ) ) return "error " + error;
+    string methods = pipelineMethods( imWIDTH, imHEIGHT );
+    convolve();
+    bool written = savePixmap( output, IN, imWIDTH, imHEIGHT, error );
+    destroy();
+    if( !written ) return "error " + error;
+
+    auto finished = chrono::steady_clock::now();
+    ostringstream reply;
+    reply << "ok " << chrono::duration<double, milli>( started - received ).count()
+          << " " << chrono::duration<double, milli>( finished - started ).count() << " " << methods;
+    return reply.str();
+}
+
+void serveClient( int client ){
+    string pending;
+    char buffer[4096];
+    ssize_t count;
+    while( ( count = read( client, buffer, sizeof( buffer ) ) ) > 0 ){
+        pending.append( buffer, count );
+        size_t end;
+        while( ( end = pending.find( '\n' ) ) != string::npos ){
+            string job = pending.substr( 0, end );
+            pending.erase( 0, end + 1 );
+            if( !job.empty() && job.back() == '\r' ) job.pop_back();
+            if( job.empty() ) continue;
+
+            string reply = runJob( job ) + "\n";
+            if( write( client, reply.data(), reply.size() ) < 0 ){
+                close( client );
+                return;
+            }
+        }
+    }
+    close( client );
+}
+
+void acceptClients( int listener ){
+    while( true ){
+        int client = accept( listener, NULL, NULL );
+        if( client < 0 ) continue;
+        timeval timeout = { CLIENT_TIMEOUT, 0 };
+        setsockopt( client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+        serveClient( client );
+    }
+}
+
+void requestShutdown( int signal ){
+    char byte = 0;
+    if( write( SHUTDOWN_PIPE[1], &byte, 1 ) < 0 ) return;
+}
+
+void awaitShutdown( string socket_path ){
+    char byte;
+    while( read( SHUTDOWN_PIPE[0], &byte, 1 ) < 0 );
+    // held until the end, so no job starts while the globals are torn down
+    JOB_LOCK.lock();
+    unlink( socket_path.c_str() );
+    cout << "Stopped serving on " << socket_path << endl;
+    exit( 0 );
+}
+
+void serve( string socket_path ){
+    // a client hanging up early must not kill the server
+    signal( SIGPIPE, SIG_IGN );
+
+    sockaddr_un address;
+    memset( &address, 0, sizeof( address ) );
+    address.sun_family = AF_UNIX;
+    if( socket_path.size() >= sizeof( address.sun_path ) ){
+        cerr << "Socket path too long: " << socket_path << ". Exiting... " << endl;
+        exit( 1 );
+    }
+    strcpy( address.sun_path, socket_path.c_str() );
+
+    int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+    unlink( socket_path.c_str() );
+    if( listener < 0 || ::bind( listener, ( sockaddr* )&address, sizeof( address ) ) != 0 || listen( listener, 64 ) != 0 ){
+        cerr << "Failed to listen on socket: " << socket_path << ". Exiting... " << endl;
+        exit( 1 );
+    }
+    cout << "Serving on " << socket_path << endl;
+
+    if( pipe( SHUTDOWN_PIPE ) == 0 ){
+        thread( awaitShutdown, socket_path ).detach();
+        signal( SIGINT, requestShutdown );
+        signal( SIGTERM, requestShutdown );
+    }
+
+    // this thread is one of the SERVE_CLIENTS
+    vector<thread> servers;
+    for( int i=1; i<SERVE_CLIENTS; i++ ) servers.push_back( thread( acceptClients, listener ) );
+    acceptClients( listener );
+}
@@ -0,0 +1,380 @@
+/*
+    Vectorized inner loops for the planar convolution paths.
+
+    Every path boils down to acc[k] += weight * in[k] over a row segment of
+    one colour plane. The AVX2 and SSE versions are picked at runtime from
+    what the cpu supports, with a scalar fallback. They multiply and add in
+    separate steps, in the same order as the scalar loop, so all of them
+    produce the same bits.
+*/
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+enum SimdLevel{ SIMD_SCALAR, SIMD_SSE, SIMD_AVX2 };
+
+// highest instruction set the inner loops may use, lowered by --simd
+SimdLevel SIMD_LIMIT = SIMD_AVX2;
+
+typedef void ( *AxpyRow )( float* acc, const float* in, float weight, int n );
+
+/*
+    Returns the best instruction set the cpu supports.
+*/
+SimdLevel cpuSimdLevel();
+
+/*
+    Returns the instruction set the inner loops run with: the best one the
+    cpu supports, capped at SIMD_LIMIT.
+*/
+SimdLevel simdLevel();
+
+/*
+    Returns the acc += weight * in row routine for simdLevel().
+*/
+AxpyRow axpyRow();
+
+/*
+    Fixed point counterpart of AxpyRow, for two rows of taps at once:
+    acc[k] += wa * a[k] + wb * b[k], with int32 sums of 16 bit pixel values
+    and weights. The weights come packed as wa in the low and wb in the high
+    16 bits of one int, see pairWeights(). The vector versions interleave a
+    and b into 16 bit pairs, so each multiply-add does both taps of 4 (SSE)
+    or 8 (AVX2) pixels. Integer sums are the same whatever the order, so
+    every level produces the same bits.
+*/
+typedef void ( *AxpyFixedRow )( int* acc, const short* a, const short* b, int weights, int n );
+
+/*
+    Packs two 16 bit weights for AxpyFixedRow.
+*/
+int pairWeights( short wa, short wb );
+
+/*
+    Returns the fixed point row routine for simdLevel().
+*/
+AxpyFixedRow axpyFixedRow();
+
+/*
+    Name of a SimdLevel, as accepted by --simd.
+*/
+string simdName( SimdLevel level );
+
+/*
+    acc[k] += weight * ( in[k] + mirror[k] ), or with mirror[k] subtracted:
+    the two taps of a symmetric or antisymmetric kernel for one multiply.
+*/
+typedef void ( *FoldRow )( float* acc, const float* in, const float* mirror, float weight, int n );
+
+/*
+    Returns the fold routine for simdLevel() that adds the mirrored taps for
+    sign 1 and subtracts them for sign -1.
+*/
+FoldRow foldRow( int sign );
+
+/*
+    Fixed size 2d kernels, for the common sizes 3, 5, 7, 9 and 11. out[k]
+    gets the sum over M rows of N weights of weights[i*N+j] * lines[i][k+j],
+    with the loops over the taps unrolled at compile time and the sums kept
+    in registers. M is N, or less for kernels whose mirrored rows were
+    folded into lines. With H set, the row taps are folded as well: the
+    first half of each row is applied to lines[i][k+j] plus H times
+    lines[i][k+N-1-j], then the centre. The taps are added in the same order
+    as the axpy and fold loops.
+*/
+typedef void ( *FixedRow )( float* out, const float* const* lines, const float* weights, int n );
+
+/*
+    Returns the fixed size routine for rows x size weights folded by hsign
+    at simdLevel(), or NULL for sizes without one and for scalar code.
+*/
+FixedRow fixedRowKernel( int size, int rows, int hsign );
+
+
+void axpyScalar( float* acc, const float* in, float weight, int n ){
+    for( int k=0; k<n; k++ ) acc[k] += weight * in[k];
+}
+
+int pairWeights( short wa, short wb ){
+    return ( int )( ( unsigned short )wa | ( unsigned )( unsigned short )wb << 16 );
+}
+
+
+void axpyFixedScalar( int* acc, const short* a, const short* b, int weights, int n ){
+    short wa = ( short )( weights & 0xffff ), wb = ( short )( weights >> 16 );
+    for( int k=0; k<n; k++ ) acc[k] += wa * a[k] + wb * b[k];
+}
+
+template<int S>
+void foldScalar( float* acc, const float* in, const float* mirror, float weight, int n ){
+    for( int k=0; k<n; k++ ) acc[k] += weight * ( S > 0 ? in[k] + mirror[k] : in[k] - mirror[k] );
+}
+
+template<int M, int N, int H>
+void fixedRowScalar( float* out, const float* const* lines, const float* weights, int n ){
+    const int R = N / 2;
+    for( int k=0; k<n; k++ ){
+        float sum = 0.0f;
+        for( int i=0; i<M; i++ ){
+            const float* line = lines[i] + k;
+            for( int j=0; j<( H ? R : N ); j++ )
+                sum += weights[i * N + j] * ( H == 0 ? line[j] : H > 0 ? line[j] + line[N - 1 - j] : line[j] - line[N - 1 - j] );
+            if( H > 0 ) sum += weights[i * N + R] * line[R];
+        }
+        out[k] = sum;
+    }
+}
+
+#ifdef SIMD_X86
+__attribute__(( target( "sse2" ) ))
+void axpySSE( float* acc, const float* in, float weight, int n ){
+    __m128 w = _mm_set1_ps( weight );
+    int k = 0;
+    for( ; k+8<=n; k+=8 ){
+        __m128 a0 = _mm_add_ps( _mm_loadu_ps( acc + k ), _mm_mul_ps( w, _mm_loadu_ps( in + k ) ) );
+        __m128 a1 = _mm_add_ps( _mm_loadu_ps( acc + k + 4 ), _mm_mul_ps( w, _mm_loadu_ps( in + k + 4 ) ) );
+        _mm_storeu_ps( acc + k, a0 );
+        _mm_storeu_ps( acc + k + 4, a1 );
+    }
+    for( ; k<n; k++ ) acc[k] += weight * in[k];
+}
+
+__attribute__(( target( "avx2" ) ))
+void axpyAVX2( float* acc, const float* in, float weight, int n ){
+    __m256 w = _mm256_set1_ps( weight );
+    int k = 0;
+    for( ; k+16<=n; k+=16 ){
+        __m256 a0 = _mm256_add_ps( _mm256_loadu_ps( acc + k ), _mm256_mul_ps( w, _mm256_loadu_ps( in + k ) ) );
+        __m256 a1 = _mm256_add_ps( _mm256_loadu_ps( acc + k + 8 ), _mm256_mul_ps( w, _mm256_loadu_ps( in + k + 8 ) ) );
+        _mm256_storeu_ps( acc + k, a0 );
+        _mm256_storeu_ps( acc + k + 8, a1 );
+    }
+    for( ; k+8<=n; k+=8 )
+        _mm256_storeu_ps( acc + k, _mm256_add_ps( _mm256_loadu_ps( acc + k ), _mm256_mul_ps( w, _mm256_loadu_ps( in + k ) ) ) );
+    for( ; k<n; k++ ) acc[k] += weight * in[k];
+}
+
+template<int S>
+__attribute__(( target( "sse2" ) ))
+void foldSSE( float* acc, const float* in, const float* mirror, float weight, int n ){
+    __m128 w = _mm_set1_ps( weight );
+    int k = 0;
+    for( ; k+4<=n; k+=4 ){
+        __m128 a = _mm_loadu_ps( in + k ), b = _mm_loadu_ps( mirror + k );
+        __m128 taps = S > 0 ? _mm_add_ps( a, b ) : _mm_sub_ps( a, b );
+        _mm_storeu_ps( acc + k, _mm_add_ps( _mm_loadu_ps( acc + k ), _mm_mul_ps( w, taps ) ) );
+    }
+    foldScalar<S>( acc + k, in + k, mirror + k, weight, n - k );
+}
+
+template<int S>
+__attribute__(( target( "avx2" ) ))
+void foldAVX2( float* acc, const float* in, const float* mirror, float weight, int n ){
+    __m256 w = _mm256_set1_ps( weight );
+    int k = 0;
+    for( ; k+8<=n; k+=8 ){
+        __m256 a = _mm256_loadu_ps( in + k ), b = _mm256_loadu_ps( mirror + k );
+        __m256 taps = S > 0 ? _mm256_add_ps( a, b ) : _mm256_sub_ps( a, b );
+        _mm256_storeu_ps( acc + k, _mm256_add_ps( _mm256_loadu_ps( acc + k ), _mm256_mul_ps( w, taps ) ) );
+    }
+    foldScalar<S>( acc + k, in + k, mirror + k, weight, n - k );
+}
+
+// a[k] and b[k] are interleaved into one 32 bit lane, against wa and wb
+__attribute__(( target( "sse2" ) ))
+void axpyFixedSSE( int* acc, const short* a, const short* b, int weights, int n ){
+    __m128i w = _mm_set1_epi32( weights );
+    int k = 0;
+    for( ; k+8<=n; k+=8 ){
+        __m128i x = _mm_loadu_si128( ( const __m128i* )( a + k ) ), y = _mm_loadu_si128( ( const __m128i* )( b + k ) );
+        __m128i low = _mm_madd_epi16( _mm_unpacklo_epi16( x, y ), w );
+        __m128i high = _mm_madd_epi16( _mm_unpackhi_epi16( x, y ), w );
+        _mm_storeu_si128( ( __m128i* )( acc + k ), _mm_add_epi32( _mm_loadu_si128( ( const __m128i* )( acc + k ) ), low ) );
+        _mm_storeu_si128( ( __m128i* )( acc + k + 4 ), _mm_add_epi32( _mm_loadu_si128( ( const __m128i* )( acc + k + 4 ) ), high ) );
+    }
+    axpyFixedScalar( acc + k, a + k, b + k, weights, n - k );
+}
+
+// unpacking works within 128 bit halves, so low holds the sums of pixels
+// 0-3 and 8-11 and high those of 4-7 and 12-15 until they are permuted back
+__attribute__(( target( "avx2" ) ))
+void axpyFixedAVX2( int* acc, const short* a, const short* b, int weights, int n ){
+    __m256i w = _mm256_set1_epi32( weights );
+    int k = 0;
+    for( ; k+16<=n; k+=16 ){
+        __m256i x = _mm256_loadu_si256( ( const __m256i* )( a + k ) ), y = _mm256_loadu_si256( ( const __m256i* )( b + k ) );
+        __m256i low = _mm256_madd_epi16( _mm256_unpacklo_epi16( x, y ), w );
+        __m256i high = _mm256_madd_epi16( _mm256_unpackhi_epi16( x, y ), w );
+        __m256i first = _mm256_permute2x128_si256( low, high, 0x20 ), second = _mm256_permute2x128_si256( low, high, 0x31 );
+        _mm256_storeu_si256( ( __m256i* )( acc + k ), _mm256_add_epi32( _mm256_loadu_si256( ( const __m256i* )( acc + k ) ), first ) );
+        _mm256_storeu_si256( ( __m256i* )( acc + k + 8 ), _mm256_add_epi32( _mm256_loadu_si256( ( const __m256i* )( acc + k + 8 ) ), second ) );
+    }
+    axpyFixedScalar( acc + k, a + k, b + k, weights, n - k );
+}
+
+// two independent sums per iteration, so the adds of one hide the latency of the other
+template<int H>
+__attribute__(( target( "sse2" ) ))
+inline __m128 foldTapsSSE( const float* in, const float* mirror ){
+    if( H == 0 ) return _mm_loadu_ps( in );
+    __m128 a = _mm_loadu_ps( in ), b = _mm_loadu_ps( mirror );
+    return H > 0 ? _mm_add_ps( a, b ) : _mm_sub_ps( a, b );
+}
+
+template<int M, int N, int H>
+__attribute__(( target( "sse2" ) ))
+void fixedRowSSE( float* out, const float* const* lines, const float* weights, int n ){
+    const int R = N / 2;
+    int k = 0;
+    for( ; k+8<=n; k+=8 ){
+        __m128 sum0 = _mm_setzero_ps();
+        __m128 sum1 = _mm_setzero_ps();
+        for( int i=0; i<M; i++ ){
+            const float* line = lines[i] + k;
+            for( int j=0; j<( H ? R : N ); j++ ){
+                __m128 w = _mm_set1_ps( weights[i * N + j] );
+                sum0 = _mm_add_ps( sum0, _mm_mul_ps( w, foldTapsSSE<H>( line + j, line + N - 1 - j ) ) );
+                sum1 = _mm_add_ps( sum1, _mm_mul_ps( w, foldTapsSSE<H>( line + j + 4, line + N + 3 - j ) ) );
+            }
+            if( H > 0 ){
+                __m128 w = _mm_set1_ps( weights[i * N + R] );
+                sum0 = _mm_add_ps( sum0, _mm_mul_ps( w, _mm_loadu_ps( line + R ) ) );
+                sum1 = _mm_add_ps( sum1, _mm_mul_ps( w, _mm_loadu_ps( line + R + 4 ) ) );
+            }
+        }
+        _mm_storeu_ps( out + k, sum0 );
+        _mm_storeu_ps( out + k + 4, sum1 );
+    }
+    if( k < n ){
+        const float* rest[M];
+        for( int i=0; i<M; i++ ) rest[i] = lines[i] + k;
+        fixedRowScalar<M, N, H>( out + k, rest, weights, n - k );
+    }
+}
+
+template<int H>
+__attribute__(( target( "avx2" ) ))
+inline __m256 foldTapsAVX2( const float* in, const float* mirror ){
+    if( H == 0 ) return _mm256_loadu_ps( in );
+    __m256 a = _mm256_loadu_ps( in ), b = _mm256_loadu_ps( mirror );
+    return H > 0 ? _mm256_add_ps( a, b ) : _mm256_sub_ps( a, b );
+}
+
+template<int M, int N, int H>
+__attribute__(( target( "avx2" ) ))
+void fixedRowAVX2( float* out, const float* const* lines, const float* weights, int n ){
+    const int R = N / 2;
+    int k = 0;
+    for( ; k+16<=n; k+=16 ){
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        for( int i=0; i<M; i++ ){
+            const float* line = lines[i] + k;
+            for( int j=0; j<( H ? R : N ); j++ ){
+                __m256 w = _mm256_broadcast_ss( weights + i * N + j );
+                sum0 = _mm256_add_ps( sum0, _mm256_mul_ps( w, foldTapsAVX2<H>( line + j, line + N - 1 - j ) ) );
+                sum1 = _mm256_add_ps( sum1, _mm256_mul_ps( w, foldTapsAVX2<H>( line + j + 8, line + N + 7 - j ) ) );
+            }
+            if( H > 0 ){
+                __m256 w = _mm256_broadcast_ss( weights + i * N + R );
+                sum0 = _mm256_add_ps( sum0, _mm256_mul_ps( w, _mm256_loadu_ps( line + R ) ) );
+                sum1 = _mm256_add_ps( sum1, _mm256_mul_ps( w, _mm256_loadu_ps( line + R + 8 ) ) );
+            }
+        }
+        _mm256_storeu_ps( out + k, sum0 );
+        _mm256_storeu_ps( out + k + 8, sum1 );
+    }
+    if( k < n ){
+        const float* rest[M];
+        for( int i=0; i<M; i++ ) rest[i] = lines[i] + k;
+        fixedRowScalar<M, N, H>( out + k, rest, weights, n - k );
+    }
+}
+#endif
+
+template<int M, int N, int H>
+FixedRow fixedRowFor( SimdLevel level ){
+    switch( level ){
+#ifdef SIMD_X86
+        case SIMD_AVX2: return fixedRowAVX2<M, N, H>;
+        case SIMD_SSE: return fixedRowSSE<M, N, H>;
+#endif
+        // the plain axpy loops vectorize better than a scalar sum per pixel
+        default: return NULL;
+    }
+}
+
+// all rows, the top half and the centre of a symmetric kernel, or only the
+// top half of an antisymmetric one, each with the row taps folded or not
+template<int N>
+FixedRow fixedRowFor( SimdLevel level, int rows, int hsign ){
+    const int R = N / 2;
+    if( rows == N ) return hsign > 0 ? fixedRowFor<N, N, 1>( level ) : hsign < 0 ? fixedRowFor<N, N, -1>( level ) : fixedRowFor<N, N, 0>( level );
+    if( rows == R + 1 ) return hsign > 0 ? fixedRowFor<R + 1, N, 1>( level ) : hsign < 0 ? fixedRowFor<R + 1, N, -1>( level ) : fixedRowFor<R + 1, N, 0>( level );
+    if( rows == R ) return hsign > 0 ? fixedRowFor<R, N, 1>( level ) : hsign < 0 ? fixedRowFor<R, N, -1>( level ) : fixedRowFor<R, N, 0>( level );
+    return NULL;
+}
+
+FixedRow fixedRowKernel( int size, int rows, int hsign ){
+    switch( size ){
+        case 3: return fixedRowFor<3>( simdLevel(), rows, hsign );
+        case 5: return fixedRowFor<5>( simdLevel(), rows, hsign );
+        case 7: return fixedRowFor<7>( simdLevel(), rows, hsign );
+        case 9: return fixedRowFor<9>( simdLevel(), rows, hsign );
+        case 11: return fixedRowFor<11>( simdLevel(), rows, hsign );
+        default: return NULL;
+    }
+}
+
+SimdLevel cpuSimdLevel(){
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2" ) ) return SIMD_AVX2;
+    if( __builtin_cpu_supports( "sse2" ) ) return SIMD_SSE;
+#endif
+    return SIMD_SCALAR;
+}
+
+SimdLevel simdLevel(){
+    static SimdLevel supported = cpuSimdLevel();
+    return min( supported, SIMD_LIMIT );
+}
+
+AxpyRow axpyRow(){
+    switch( simdLevel() ){
+#ifdef SIMD_X86
+        case SIMD_AVX2: return axpyAVX2;
+        case SIMD_SSE: return axpySSE;
+#endif
+        default: return axpyScalar;
+    }
+}
+
+FoldRow foldRow( int sign ){
+    switch( simdLevel() ){
+#ifdef SIMD_X86
+        case SIMD_AVX2: return sign > 0 ? foldAVX2<1> : foldAVX2<-1>;
+        case SIMD_SSE: return sign > 0 ? foldSSE<1> : foldSSE<-1>;
+#endif
+        default: return sign > 0 ? foldScalar<1> : foldScalar<-1>;
+    }
+}
+
+AxpyFixedRow axpyFixedRow(){
+    switch( simdLevel() ){
+#ifdef SIMD_X86
+        case SIMD_AVX2: return axpyFixedAVX2;
+        case SIMD_SSE: return axpyFixedSSE;
+#endif
+        default: return axpyFixedScalar;
+    }
+}
+
+string simdName( SimdLevel level ){
+    switch( level ){
+        case SIMD_AVX2: return "avx2";
+        case SIMD_SSE: return "sse";
+        default: return "scalar";
+    }
+}
@@ -0,0 +1,166 @@
+/*
+    Streaming convolution for images too large to hold in memory.
+
+    Scanlines are read one at a time into a ring of kernelSIZE rows, each
+    output row is convolved as soon as the rows under the kernel are in,
+    and written out straight away. Peak memory is a few rows per kernel
+    row, independent of the image height.
+*/
+
+// set by --stream, headless images are then convolved scanline by scanline
+bool STREAM = false;
+
+/*
+    One ring slot: the rgb planes of a scanline, padded by kernelRADIUS
+    zeros on each side, and its alpha channel. For separable kernels the
+    planes hold the horizontal pass instead of the raw row.
+*/
+struct StreamRow{
+    vector<float> planes;
+    vector<unsigned char> alpha;
+};
+
+/*
+    Convolves input_file into output_file one scanline at a time with the
+    direct or separable planar path, the only ones that work a row at a
+    time. Wrap borders need the far side of the image and are not supported.
+*/
+void streamConvolve( string input_file, string output_file );
+
+
+void streamConvolve( string input_file, string output_file ){
+    PROFILE_SCOPE( "streamConvolve" );
+    auto infile = ImageInput::open( input_file );
+    if ( !infile ){
+        cerr << "Failed to open input file: " << input_file << ". Exiting... " << endl;
+        exit( 1 );
+    }
+    int width = infile->spec().width;
+    int height = infile->spec().height;
+    int channels = infile->spec().nchannels;
+
+    // checked before the output is created, so a refused input leaves no
+    // empty file behind
+    if( kernelBORDER == BORDER_WRAP ){
+        cerr << "Wrap borders cannot be streamed: " << input_file << ". Exiting... " << endl;
+        exit( 1 );
+    }
+
+    auto outfile = ImageOutput::create( output_file );
+    if( !outfile ){
+        cerr << "Failed to create output file: " << output_file << ". Exiting... " << endl;
+        exit( 1 );
+    }
+    ImageSpec spec( width, height, 4, TypeDesc::UINT8 );
+    if( !outfile->open( output_file, spec ) ){
+        cerr << "Failed to open output file: " << output_file << ". Exiting... " << endl;
+        exit( 1 );
+    }
+
+    bool separable = kernelSEPARABLE && METHOD != METHOD_DIRECT && METHOD != METHOD_NAIVE;
+    int stride = width + 2 * kernelRADIUS;
+    AxpyRow axpy = axpyRow();
+
+    vector<StreamRow> ring( kernelSIZE );
+    for( auto &slot : ring ){
+        slot.planes.resize( 3 * stride );
+        slot.alpha.resize( width );
+    }
+    // rows above and below the image
+    vector<float> zeros( 3 * stride, 0.0f );
+    vector<unsigned char> scanline( width * channels );
+    vector<float> pass( 3 * stride );
+    vector<float> acc( 3 * width );
+    vector<Pixel> out( width );
+
+    // the file is read top scanline first. Rows are brought into the ring
+    // kernelRADIUS ahead of the row being written
+    int next = 0;
+    for( int t=0; t<height; t++ ){
+        for( ; next<=t+kernelRADIUS && next<height; next++ ){
+            if( !infile->read_scanlines( next, next + 1, 0, TypeDesc::UINT8, &scanline[0] ) ){
+                cerr << "Failed to read file " << input_file << ". Exiting... " << endl;
+                exit( 1 );
+            }
+
+            StreamRow& slot = ring[next % kernelSIZE];
+            fill( slot.planes.begin(), slot.planes.end(), 0.0f );
+            float* r = &slot.planes[kernelRADIUS];
+            float* g = r + stride;
+            float* b = g + stride;
+            for( int x=0; x<width; x++ ){
+                const unsigned char* pixel = &scanline[x * channels];
+                if( channels < 3 ){
+                    r[x] = g[x] = b[x] = pixel[0];
+                } else {
+                    r[x] = pixel[0];
+                    g[x] = pixel[1];
+                    b[x] = pixel[2];
+                }
+                slot.alpha[x] = channels == 4 ? pixel[3] : channels == 2 ? pixel[1] : 255;
+            }
+            if( kernelBORDER != BORDER_ZERO )
+                for( int c=0; c<3; c++ ){
+                    float* plane = &slot.planes[c * stride + kernelRADIUS];
+                    for( int x=-kernelRADIUS; x<0; x++ ) plane[x] = plane[borderIndex( x, width )];
+                    for( int x=width; x<width+kernelRADIUS; x++ ) plane[x] = plane[borderIndex( x, width )];
+                }
+
+            if( separable ){
+                // replace the raw row by its horizontal pass
+                fill( pass.begin(), pass.end(), 0.0f );
+                for( int c=0; c<3; c++ )
+                    for( int j=0; j<kernelSIZE; j++ )
+                        if( kernelROW[j] != 0.0f )
+                            axpy( &pass[c * stride + kernelRADIUS], &slot.planes[c * stride] + j, kernelROW[j], width );
+                slot.planes.swap( pass );
+            }
+        }
+
+        // KERNEL row i applies kernelRADIUS - i rows further down the file,
+        // since it is laid out for bottom first pixmaps. Clamped and mirrored
+        // rows past the ends are never more than kernelRADIUS back, so they
+        // are still in the ring
+        int chunks = ( width + TILE_SIZE - 1 ) / TILE_SIZE;
+        parallelFor( chunks, [&]( int chunk ){
+            int x0 = chunk * TILE_SIZE;
+            int n = min( TILE_SIZE, width - x0 );
+            for( int c=0; c<3; c++ ){
+                float* sums = &acc[c * width + x0];
+                fill( sums, sums + n, 0.0f );
+                for( int i=0; i<kernelSIZE; i++ ){
+                    int row = borderIndex( t + kernelRADIUS - i, height );
+                    const float* line = ( row < 0 ? &zeros[0] : &ring[row % kernelSIZE].planes[0] ) + c * stride;
+                    if( separable ){
+                        if( kernelCOLUMN[i] != 0.0f ) axpy( sums, line + kernelRADIUS + x0, kernelCOLUMN[i], n );
+                        continue;
+                    }
+                    for( int j=0; j<kernelSIZE; j++ ){
+                        float weight = KERNEL[i * kernelSIZE + j];
+                        if( weight != 0.0f ) axpy( sums, line + x0 + j, weight, n );
+                    }
+                }
+            }
+        });
+
+        const unsigned char* alpha = &ring[t % kernelSIZE].alpha[0];
+        for( int x=0; x<width; x++ ){
+            out[x].r = clampChannel( acc[x] );
+            out[x].g = clampChannel( acc[width + x] );
+            out[x].b = clampChannel( acc[2 * width + x] );
+            out[x].a = alpha[x];
+        }
+        if( !outfile->write_scanline( t, 0, TypeDesc::UINT8, &out[0] ) ){
+            cerr << "Failed to write to output file: " << output_file << ". Exiting... " << endl;
+            exit( 1 );
+        }
+    }
+
+    PROFILE_COUNT( COUNT_PIXELS, (long long)width * height );
+    PROFILE_COUNT( COUNT_BYTES_READ, (long long)width * height * channels );
+    PROFILE_COUNT( COUNT_BYTES_WRITTEN, (long long)width * height * sizeof( Pixel ) );
+    PROFILE_COUNT( COUNT_MACS, kernelMACs( separable ? METHOD_SEPARABLE : METHOD_DIRECT, width, height ) );
+
+    infile->close();
+    outfile->close();
+}
@@ -0,0 +1,195 @@
+/*
+    Thread pool used to spread image work over the available cores.
+
+    Work is handed out as a count of independent items (tiles, rows, ...).
+    Each thread starts on its own contiguous share of the items and, once it
+    runs dry, steals items from the back of the other threads' shares, so
+    uneven items at the image borders do not leave cores idle.
+
+    The pool runs one batch at a time. Threads other than the main one, the
+    refinement thread or server clients, may call parallelFor too and then
+    wait for the batch in progress to finish. A task that calls parallelFor
+    itself runs the inner items on its own thread.
+*/
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <atomic>
+
+// number of threads used for image work, 0 means one per hardware thread
+int THREADS = 0;
+
+// while set, parallelFor skips the items it has not started yet, so work
+// that is no longer wanted winds down within a tile
+atomic<bool> CANCELLED( false );
+
+// set on the pool threads, and on a caller while its batch runs
+thread_local bool IN_POOL = false;
+
+class WorkPool{
+public:
+    ~WorkPool();
+
+    /*
+        Runs task( i ) for every i in [0, count) and returns once all of them
+        are done. The calling thread takes part in the work. Callers on
+        other threads wait for their turn.
+    */
+    void run( int count, const function<void( int )>& task );
+
+private:
+    struct Share{
+        mutex lock;
+        deque<int> items;
+    };
+
+    void resize( int threads );
+    void work( int id, unsigned long seen );
+    bool next( int id, int& item );
+
+    vector<thread> workers;
+    vector<unique_ptr<Share>> shares;
+    // held by the caller for a whole batch
+    mutex running;
+    mutex lock;
+    condition_variable wake, finished;
+    const function<void( int )>* current = NULL;
+    unsigned long generation = 0;
+    int busy = 0;
+    bool stopping = false;
+};
+
+WorkPool POOL;
+
+/*
+    Returns the number of threads image work is split over.
+*/
+int threadCount();
+
+/*
+    Runs task( i ) for every i in [0, count) on the pool.
+*/
+void parallelFor( int count, const function<void( int )>& task );
+
+
+int threadCount(){
+    if( THREADS > 0 ) return THREADS;
+    int hardware = thread::hardware_concurrency();
+    return hardware > 0 ? hardware : 1;
+}
+
+void parallelFor( int count, const function<void( int )>& task ){
+    if( count <= 0 ) return;
+    if( count == 1 || threadCount() == 1 || IN_POOL ){
+        for( int i=0; i<count && !CANCELLED; i++ ) task( i );
+        return;
+    }
+    POOL.run( count, task );
+}
+
+WorkPool::~WorkPool(){
+    resize( 0 );
+}
+
+void WorkPool::resize( int threads ){
+    {
+        lock_guard<mutex> guard( lock );
+        stopping = true;
+    }
+    wake.notify_all();
+    for( auto &worker : workers ) worker.join();
+    workers.clear();
+
+    stopping = false;
+    shares.clear();
+    for( int i=0; i<threads; i++ ) shares.emplace_back( new Share );
+    // the caller is share 0, the pool threads take the rest. They start out
+    // having seen the batches run so far
+    unsigned long seen;
+    {
+        lock_guard<mutex> guard( lock );
+        seen = generation;
+    }
+    for( int i=1; i<threads; i++ ) workers.emplace_back( &WorkPool::work, this, i, seen );
+}
+
+void WorkPool::run( int count, const function<void( int )>& task ){
+    lock_guard<mutex> turn( running );
+    int threads = threadCount();
+    if( (int)shares.size() != threads ) resize( threads );
+
+    // deal the items out in contiguous runs, one per thread
+    for( int i=0; i<threads; i++ ){
+        int begin = (long)count * i / threads;
+        int end = (long)count * ( i + 1 ) / threads;
+        for( int item=begin; item<end; item++ ) shares[i]->items.push_back( item );
+    }
+
+    {
+        lock_guard<mutex> guard( lock );
+        current = &task;
+        busy = threads - 1;
+        generation++;
+    }
+    wake.notify_all();
+
+    int item;
+    IN_POOL = true;
+    while( next( 0, item ) ) if( !CANCELLED ) task( item );
+    IN_POOL = false;
+
+    unique_lock<mutex> guard( lock );
+    finished.wait( guard, [this]{ return busy == 0; } );
+    current = NULL;
+}
+
+void WorkPool::work( int id, unsigned long seen ){
+    IN_POOL = true;
+    while( true ){
+        const function<void( int )>* task;
+        {
+            unique_lock<mutex> guard( lock );
+            wake.wait( guard, [&]{ return stopping || generation != seen; } );
+            if( stopping ) return;
+            seen = generation;
+            task = current;
+        }
+
+        int item;
+        if( task ) while( next( id, item ) ) if( !CANCELLED ) ( *task )( item );
+
+        {
+            lock_guard<mutex> guard( lock );
+            busy--;
+        }
+        finished.notify_one();
+    }
+}
+
+bool WorkPool::next( int id, int& item ){
+    // own share first, from the front
+    {
+        Share& own = *shares[id];
+        lock_guard<mutex> guard( own.lock );
+        if( !own.items.empty() ){
+            item = own.items.front();
+            own.items.pop_front();
+            return true;
+        }
+    }
+    // then steal from the back of the others
+    int threads = shares.size();
+    for( int i=1; i<threads; i++ ){
+        Share& victim = *shares[( id + i ) % threads];
+        lock_guard<mutex> guard( victim.lock );
+        if( !victim.items.empty() ){
+            item = victim.items.back();
+            victim.items.pop_back();
+            return true;
+        }
+    }
+    return false;
+}